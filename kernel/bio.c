@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -8,84 +8,322 @@
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+// * breadv and bwritev do the same for several blocks at once,
+//     keeping the disk busy with all of them together.
+// * breada starts reading blocks that will be wanted soon,
+//     without waiting for them.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
-
+//
+// The cache grows on misses, a page of buffers (a group)
+// at a time, while there is plenty of free memory, up to a
+// limit set by the size of RAM. After that, and when memory
+// is short, a miss recycles a buffer that hasn't been used
+// recently. breclaim() frees whole groups when memory runs
+// low. The cache never shrinks below NBUF buffers.
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "memstat.h"
 
-struct {
+#define NBUCKET  1021
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define BPG      (PGSIZE / BSIZE)  // buffers per group
+#define BGROWMIN 1024  // grow only while more pages than this are free
+#define BBATCH   32    // most reads breadv() or breada() starts at once
+
+// A page of buffer data, and the buffers that use it.
+struct bufgroup {
+  struct bufgroup *next;  // ring of all groups
+  struct bufgroup *prev;
+  char *data;             // from kalloc()
+  struct buf buf[BPG];
+};
+
+// The cached buffers are spread over a hash table keyed by
+// (dev, blockno), each bucket with its own lock, so that
+// lookups of different blocks don't contend. A bucket's
+// lock protects its list and the refcnt, used and dirty
+// flags of the buffers on it. Unused buffers wait in the bucket
+// for block 0 of device 0, which is never read.
+//
+// bcache.lock serializes misses and protects the ring
+// of groups, the clock hand over it, and b->dev and
+// b->blockno, which only change while a buffer is unused
+// and out of any bucket. Holding it, a CPU may hold a
+// bucket lock as well.
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // through next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;
+  struct bucket bucket[NBUCKET];
+  struct kmem_cache *cache;  // struct bufgroup
+  struct bufgroup *hand;     // clock hand: buffer handi of group hand
+  int handi;
+  int nbuf;                  // buffers in all groups
+  int nblank;                // of them, ones that have never held a block
+  int max;                   // high-water mark for nbuf
+  uint64 nhit;               // lookups that found the block cached
+  uint64 nmiss;
+  uint64 nahead;             // blocks breada() was asked for
 } bcache;
 
+static void
+bunlink(struct bucket *k, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &k->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+}
+
+static void
+blink(struct bucket *k, struct buf *b)
+{
+  b->next = k->head;
+  k->head = b;
+}
+
+// Allocate a group of unused buffers.
+// Returns 0 if out of memory.
+static struct bufgroup*
+bgroupalloc(void)
+{
+  struct bufgroup *g;
+
+  if((g = kmem_cache_alloc(bcache.cache)) == 0)
+    return 0;
+  if((g->data = kalloc()) == 0){
+    kmem_cache_free(bcache.cache, g);
+    return 0;
+  }
+  for(int i = 0; i < BPG; i++){
+    initsleeplock(&g->buf[i].lock, "buffer");
+    g->buf[i].data = (uchar*)g->data + i*BSIZE;
+    g->buf[i].dev = 0;
+    g->buf[i].blockno = 0;
+    g->buf[i].refcnt = 0;
+    g->buf[i].used = 0;
+    g->buf[i].async = 0;
+    g->buf[i].dirty = 0;
+  }
+  return g;
+}
+
+// Add g's buffers to the cache, under the clock hand
+// so that they are the next ones bget() recycles.
+// Caller must hold bcache.lock.
+static void
+bgroupadd(struct bufgroup *g)
+{
+  struct bucket *k = &bcache.bucket[BHASH(0, 0)];
+
+  if(bcache.hand){
+    g->next = bcache.hand;
+    g->prev = bcache.hand->prev;
+    g->next->prev = g;
+    g->prev->next = g;
+  } else {
+    g->next = g->prev = g;
+  }
+  bcache.hand = g;
+  bcache.handi = 0;
+  bcache.nbuf += BPG;
+  bcache.nblank += BPG;
+
+  acquire(&k->lock);
+  for(int i = 0; i < BPG; i++)
+    blink(k, &g->buf[i]);
+  release(&k->lock);
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bufgroup *g;
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  bcache.cache = kmem_cache_create("bufgroup", sizeof(struct bufgroup));
+  bcache.max = (PHYSTOP - KERNBASE) / BSIZE / 32;
+  if(bcache.max < NBUF)
+    bcache.max = NBUF;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  acquire(&bcache.lock);
+  while(bcache.nbuf < NBUF){
+    if((g = bgroupalloc()) == 0)
+      panic("binit");
+    bgroupadd(g);
   }
+  release(&bcache.lock);
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Find block blockno of dev in bucket k, and take a
+// reference to it. Caller must hold k->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+blookup(struct bucket *k, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = k->head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->used = 1;
       return b;
     }
   }
+  return 0;
+}
+
+// Move the clock hand on by one buffer.
+// Caller must hold bcache.lock.
+static void
+bhandnext(void)
+{
+  if(++bcache.handi == BPG){
+    bcache.handi = 0;
+    bcache.hand = bcache.hand->next;
+  }
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+// Find a buffer to recycle with the clock algorithm:
+// one that is unused, and hasn't been used since the
+// hand last passed. Takes it out of its bucket.
+// Returns 0 if all buffers are in use.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct bucket *k;
+  struct buf *b;
+
+  for(int n = 0; n < 2*bcache.nbuf; n++){
+    b = &bcache.hand->buf[bcache.handi];
+    bhandnext();
+    k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&k->lock);
+    if(b->refcnt == 0 && !b->used && !b->dirty){
+      bunlink(k, b);
+      release(&k->lock);
       return b;
     }
+    b->used = 0;
+    release(&k->lock);
   }
-  panic("bget: no buffers");
+  return 0;
+}
+
+// Should a miss grow the cache? Only if it has no blank
+// buffers left, and there is plenty of free memory.
+static int
+bcangrow(void)
+{
+  struct memstat st;
+
+  if(bcache.nblank > 0 || bcache.nbuf >= bcache.max)
+    return 0;
+  kmemstat(&st);
+  return st.nfree > BGROWMIN;
+}
+
+// Lock b, which the caller found cached, and return it.
+// Unless wait is set, give b up and return 0 instead of
+// waiting if someone else holds it.
+static struct buf*
+bgetlock(struct buf *b, int wait)
+{
+  struct bucket *k;
+
+  if(wait){
+    acquiresleep(&b->lock);
+    return b;
+  }
+  if(tryacquiresleep(&b->lock))
+    return b;
+  k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&k->lock);
+  b->refcnt--;
+  release(&k->lock);
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer; or, if wait
+// is 0 and another thread holds it, return 0.
+static struct buf*
+bget(uint dev, uint blockno, int wait)
+{
+  struct bucket *k = &bcache.bucket[BHASH(dev, blockno)];
+  struct bufgroup *g = 0;
+  struct buf *b;
+
+  // Is the block already cached?
+  acquire(&k->lock);
+  b = blookup(k, dev, blockno);
+  release(&k->lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    return bgetlock(b, wait);
+  }
+  __sync_fetch_and_add(&bcache.nmiss, 1);
+
+  // Not cached. kalloc() may call breclaim(), so
+  // allocate any new buffers before taking bcache.lock.
+  if(bcangrow())
+    g = bgroupalloc();
+
+  for(;;){
+    acquire(&bcache.lock);
+    if(g)
+      bgroupadd(g);
+
+    // Another CPU may have been caching it
+    // while we didn't hold k->lock; look again.
+    acquire(&k->lock);
+    b = blookup(k, dev, blockno);
+    release(&k->lock);
+    if(b){
+      release(&bcache.lock);
+      return bgetlock(b, wait);
+    }
+
+    if((b = bvictim()) != 0)
+      break;
+
+    // every buffer is in use; make more.
+    release(&bcache.lock);
+    if((g = bgroupalloc()) == 0)
+      panic("bget: no buffers");
+  }
+
+  if(b->dev == 0)
+    bcache.nblank--;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->used = 1;
+  acquire(&k->lock);
+  blink(k, b);
+  release(&k->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,7 +332,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 1);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -102,6 +340,91 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return in bs[] locked bufs with the contents of the n
+// blocks in blocknos[], reading the ones that aren't cached
+// with one batch of disk requests.
+void
+breadv(uint dev, uint *blocknos, int n, struct buf **bs)
+{
+  struct buf *miss[BBATCH];
+  int i = 0, m;
+
+  while(i < n){
+    for(m = 0; i < n && m < BBATCH; i++){
+      bs[i] = bget(dev, blocknos[i], 1);
+      if(!bs[i]->valid)
+        miss[m++] = bs[i];
+    }
+    virtio_disk_start(miss, m, 0);
+    for(int j = 0; j < m; j++){
+      virtio_disk_wait(miss[j]);
+      miss[j]->valid = 1;
+    }
+  }
+}
+
+// Is the block cached? Doesn't count as a use.
+static int
+bcached(uint dev, uint blockno)
+{
+  struct bucket *k = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  acquire(&k->lock);
+  for(b = k->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&k->lock);
+  return b != 0;
+}
+
+// Start reading the n blocks in blocknos[] into the cache,
+// for a caller that expects to want them soon, and return
+// without waiting. Skips the ones already cached, or that
+// another thread has locked: sleeping on those while holding
+// the buffers taken so far could deadlock with it. Each
+// buffer stays locked until bdone(), so a bread() of it
+// meanwhile waits for the read to finish.
+void
+breada(uint dev, uint *blocknos, int n)
+{
+  struct buf *miss[BBATCH], *b;
+  int m = 0;
+
+  __sync_fetch_and_add(&bcache.nahead, n);
+  for(int i = 0; i < n && m < BBATCH; i++){
+    if(bcached(dev, blocknos[i]))
+      continue;
+    if((b = bget(dev, blocknos[i], 0)) == 0)
+      continue;
+    if(b->valid){
+      brelse(b);
+      continue;
+    }
+    b->async = 1;
+    miss[m++] = b;
+  }
+  if(m == 0)
+    return;
+  virtio_disk_start(miss, m, 0);
+}
+
+// Called by virtio_disk_intr() when a read that breada()
+// started is done. Nobody waits for it, so release the
+// buffer here, on behalf of the process that started it.
+void
+bdone(struct buf *b)
+{
+  struct bucket *k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  b->async = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  acquire(&k->lock);
+  b->refcnt--;
+  release(&k->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +434,155 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the contents of the n locked bufs in bs[] to disk,
+// all in one batch, and wait for them.
+void
+bwritev(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+  virtio_disk_start(bs, n, 1);
+  for(int i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *k;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&k->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&k->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&k->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&k->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&k->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&k->lock);
+}
+
+// The log has committed b, but not yet written it to its
+// home location: the cache must keep it until bclean().
+void
+bdirty(struct buf *b)
+{
+  struct bucket *k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&k->lock);
+  b->dirty = 1;
+  release(&k->lock);
+}
+
+// The log has written b to its home location: it no
+// longer needs to stay in the cache for the log's sake.
+void
+bclean(struct buf *b)
+{
+  struct bucket *k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&k->lock);
+  b->dirty = 0;
+  b->refcnt--;
+  release(&k->lock);
 }
 
+// Take the buffers of the group under the clock hand out
+// of their buckets, if none is in use or has been used
+// since the hand last passed. Returns 1 if it did.
+// Caller must hold bcache.lock.
+static int
+bgrouptake(struct bufgroup *g)
+{
+  struct bucket *k;
+  struct buf *b;
+  int i, ok = 1;
+
+  for(i = 0; i < BPG; i++){
+    b = &g->buf[i];
+    k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&k->lock);
+    if(b->refcnt || b->used || b->dirty){
+      b->used = 0;
+      ok = 0;
+    } else {
+      bunlink(k, b);
+    }
+    release(&k->lock);
+    if(!ok)
+      break;
+  }
+  if(ok)
+    return 1;
+
+  // put back the ones already taken.
+  while(--i >= 0){
+    b = &g->buf[i];
+    k = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&k->lock);
+    blink(k, b);
+    release(&k->lock);
+  }
+  return 0;
+}
+
+// Called when memory runs low: free up to n pages of
+// buffers that haven't been used recently, keeping at
+// least NBUF. Returns the number of pages freed.
+int
+breclaim(int n)
+{
+  struct bufgroup *g;
+  int freed = 0, ngroup;
 
+  acquire(&bcache.lock);
+  ngroup = bcache.nbuf / BPG;
+  for(int i = 0; i < 2*ngroup && freed < n && bcache.nbuf - BPG >= NBUF; i++){
+    g = bcache.hand;
+    bcache.hand = g->next;
+    bcache.handi = 0;
+    if(!bgrouptake(g))
+      continue;
+    g->prev->next = g->next;
+    g->next->prev = g->prev;
+    bcache.nbuf -= BPG;
+    for(int j = 0; j < BPG; j++)
+      if(g->buf[j].dev == 0)
+        bcache.nblank--;
+    kfree(g->data);
+    kmem_cache_free(bcache.cache, g);
+    freed++;
+  }
+  release(&bcache.lock);
+  return freed;
+}
+
+// Fill in buffer cache statistics for the memstat system call.
+void
+bstat(struct memstat *st)
+{
+  st->nbuf = bcache.nbuf;
+  st->nbufhit = bcache.nhit;
+  st->nbufmiss = bcache.nmiss;
+  st->nbufahead = bcache.nahead;
+}
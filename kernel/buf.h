@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  struct buf *next; // hash bucket list
+  int used;    // looked up since bget() last looked for a buffer to recycle?
+  int async;   // being read ahead; bdone() releases it
+  int dirty;   // committed by the log, but not yet written home
+  uchar *data; // BSIZE bytes, part of a kalloc() page
 };
 
@@ -2,10 +2,16 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct spawn_action;
+struct image;
+struct seg;
+struct shm;
+struct memstat;
 struct stat;
 struct superblock;
 struct thread;
@@ -15,7 +21,15 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadv(uint, uint*, int, struct buf**);
+void            bwritev(struct buf**, int);
+void            breada(uint, uint*, int);
+void            bdone(struct buf*);
+void            bclean(struct buf*);
+void            bdirty(struct buf*);
 void            bpin(struct buf*);
+int             breclaim(int);
+void            bstat(struct memstat*);
 void            bunpin(struct buf*);
 
 // console.c
@@ -25,6 +39,14 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execload(struct proc*, char*, char**, struct image*);
+struct seg*     execseg(struct proc*, uint64);
+int             execfault(uint64, int);
+
+// fdt.c
+extern uint64   phystop;
+extern int      ncpu;
+void            fdtinit(uint64);
 
 // file.c
 struct file*    filealloc(void);
@@ -34,6 +56,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewriteop(int*);
 
 // fs.c
 void            fsinit(int);
@@ -50,7 +73,11 @@ void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
+void            readahead(struct file*, uint);
 int             readi(struct inode*, int, uint64, uint, uint);
+char*           itextpage(struct inode*, uint, uint);
+void            iexec(struct inode*);
+void            iexecput(struct inode*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -62,17 +89,44 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_pages(int);
 void            kfree(void *);
+void            kfree_pages(void *, int);
 void            kinit(void);
+void            kmemstat(struct memstat*);
+void            kref(void *);
+void            kref_pages(void *, int);
+int             krefcnt(void *);
+void            ksplit(void *, int);
+int             kzeroidle(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+int             log_maxop(void);
+void            log_sync(void);
+void            kflushd(void);
+
+// mmap.c
+uint64          mmap(uint64, uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+uint64          vmabase(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+int             vmafault(uint64, int);
+void            vmainit(void);
+void            vmaunmapall(struct proc*);
+void            shminit(struct shm*);
+void            shmwrite(struct shm*, uint, char*, uint);
+void            shmfree(struct shm*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
+void            pipeinit(void);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
@@ -86,6 +140,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct spawn_action*, int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -107,6 +162,7 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            kproc_create(void (*)(void), char*);
 uint            sigprocmask(uint);
 int             sigaction(int, uint64 act, uint64 oldact);
 void            sigret(void);
@@ -119,12 +175,29 @@ void            bsem_free(int);
 void            bsem_down(int);
 void            bsem_up(int);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapin(pagetable_t, uint64);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void*           kalloc_swap(void);
+void            kswapd(void);
+void            swapstat(struct memstat*);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slab_reclaim(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holding_spinlocks(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -132,6 +205,7 @@ void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -158,6 +232,10 @@ extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
+
+// vm.c
+extern int      useasids;
+extern struct spinlock vmlock;
 void            usertrapret(void);
 
 // uart.c
@@ -177,9 +255,17 @@ void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmsplit(pte_t*);
+int             uvminstall(pagetable_t, uint64, uint64, int);
+void            uvmprefault(uint64, uint64, int);
+int             vmfault(pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
+pte_t*          walklevel(pagetable_t, uint64, int, int*);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -194,6 +280,8 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
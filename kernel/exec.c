@@ -6,37 +6,29 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
+// Build a fresh user address space for process p from the
+// ELF file at path, with argv copied onto its stack.
+// Does not touch p's current image.
+// The program's segments are not read yet: they are
+// recorded in img, with a reference to the file, counted
+// by iexec(), and execfault() reads each page the first
+// time it is used.
+// Returns argc, or -1 on failure.
 int
-exec(char *path, char **argv)
+execload(struct proc *p, char *path, char **argv, struct image *img)
 {
-  char *s, *last;
-  int i, off;
+  int i, off, nseg = 0, locked;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
-  struct thread *curr_t = mythread();
+  struct seg *s;
+  pagetable_t pagetable = 0;
 
-// 3 Threads
-  for(struct thread *t = p->p_threads; t < &p->p_threads[NTHREAD]; t++) {
-    acquire(&t->lock);
-    if (t->tid != curr_t->tid && t->state != T_UNUSED) {
-      t->killed = 1;
-      if (t->state == T_SLEEPING) {
-        t->state = T_RUNNABLE;
-      }
-      release(&t->lock);
-      kthread_join(t->tid, 0);
-    } else {
-      release(&t->lock);
-    }
-  }
- 
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -44,6 +36,7 @@ exec(char *path, char **argv)
     return -1;
   }
   ilock(ip);
+  locked = 1;
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -54,7 +47,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments.
+  memset(img->segs, 0, sizeof(img->segs));
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -64,21 +58,35 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr + ph.memsz >= TRAPFRAME(0))
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
+    if(ph.memsz == 0)
+      continue;
+    if(nseg >= NSEG)
+      goto bad;
+    s = &img->segs[nseg++];
+    s->va = ph.vaddr;
+    s->memsz = ph.memsz;
+    s->off = ph.off;
+    s->filesz = ph.filesz;
+    s->perm = 0;
+    if(ph.flags & ELF_PROG_FLAG_READ)
+      s->perm |= PTE_R;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      s->perm |= PTE_R|PTE_W;  // W without R is reserved.
+    if(ph.flags & ELF_PROG_FLAG_EXEC)
+      s->perm |= PTE_X;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  iexec(ip);  // the file mustn't change under execfault()
+  iunlock(ip);
   end_op();
-  ip = 0;
-
-  p = myproc();
-  uint64 oldsz = p->sz;
+  locked = 0;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
@@ -113,10 +121,61 @@ exec(char *path, char **argv)
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
     goto bad;
 
+  img->pagetable = pagetable;
+  img->sz = sz;
+  img->sp = sp;
+  img->entry = elf.entry;
+  img->ip = ip;
+  return argc;
+
+ bad:
+  if(pagetable)
+    proc_freepagetable(pagetable, sz);
+  if(locked){
+    iunlockput(ip);
+    end_op();
+  } else {
+    begin_op();
+    iexecput(ip);
+    end_op();
+  }
+  return -1;
+}
+
+int
+exec(char *path, char **argv)
+{
+  char *s, *last;
+  int argc;
+  uint64 oldsz;
+  pagetable_t oldpagetable;
+  struct inode *oldip;
+  struct image img;
+  struct proc *p = myproc();
+  struct thread *curr_t = mythread();
+
+// 3 Threads
+  for(struct thread *t = p->p_threads; t < &p->p_threads[NTHREAD]; t++) {
+    acquire(&t->lock);
+    if (t->tid != curr_t->tid && t->state != T_UNUSED) {
+      t->killed = 1;
+      if (t->state == T_SLEEPING) {
+        t->state = T_RUNNABLE;
+      }
+      release(&t->lock);
+      kthread_join(t->tid, 0);
+    } else {
+      release(&t->lock);
+    }
+  }
+
+  if((argc = execload(p, path, argv, &img)) < 0)
+    return -1;
+
   // arguments to user main(argc, argv)
   // argc is returned via the system call return
   // value, which goes in a0.
-  curr_t->trapframe->a1 = sp;
+  curr_t->trapframe->a1 = img.sp;
 
   // Save program name for debugging.
   for(last=s=path; *s; s++)
@@ -125,12 +184,24 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaunmapall(p);
   oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
-  curr_t->trapframe->epc = elf.entry;  // initial program counter = main
-  curr_t->trapframe->sp = sp; // initial stack pointer
+  oldsz = p->sz;
+  oldip = p->execip;
+  acquire(&p->lock);  // kswapd looks at them
+  p->pagetable = img.pagetable;
+  p->sz = img.sz;
+  release(&p->lock);
+  p->execip = img.ip;
+  memmove(p->segs, img.segs, sizeof(p->segs));
+  curr_t->trapframe->epc = img.entry;  // initial program counter = main
+  curr_t->trapframe->sp = img.sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldip){
+    begin_op();
+    iexecput(oldip);
+    end_op();
+  }
 
 // // 2.1.2 Updating process creation behavior
   int sig;
@@ -143,41 +214,61 @@ exec(char *path, char **argv)
   p->pending_signals = 0;
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
+}
 
- bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
-  if(ip){
-    iunlockput(ip);
-    end_op();
-  }
-  return -1;
+// The segment of p's program that contains va, or 0.
+struct seg*
+execseg(struct proc *p, uint64 va)
+{
+  struct seg *s;
+
+  for(s = p->segs; s < &p->segs[NSEG]; s++)
+    if(s->memsz && va >= s->va && va < PGROUNDUP(s->va + s->memsz))
+      return s;
+  return 0;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Called by vmfault() for a fault at page va in one of
+// the current program's segments: map the page of the
+// program file, from the inode's text cache, zero-filling
+// past the end of the segment's file contents.
+// Returns 0 if the access can be retried, -1 if not.
+int
+execfault(uint64 va, int access)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+  struct proc *p = myproc();
+  struct seg *s;
+  uint64 n;
+  char *mem;
+  int perm;
+
+  if((s = execseg(p, va)) == 0 || (s->perm & access) == 0)
+    return -1;
+
+  // reading the file sleeps; see vmafault().
+  if(holding_spinlocks())
+    return -1;
+
+  n = 0;
+  if(va - s->va < s->filesz)
+    n = s->filesz - (va - s->va);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  perm = s->perm | PTE_U;
+  if(n == 0){
+    // all bss; nothing to share.
+    if((mem = kalloc_swap()) == 0)
       return -1;
+  } else {
+    // share the page with other processes running the program;
+    // a writable segment gets a private copy on the first store.
+    ilock(p->execip);
+    mem = itextpage(p->execip, s->off + (va - s->va), n);
+    iunlock(p->execip);
+    if(mem == 0)
+      return -1;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
   }
-  
-  return 0;
+  return uvminstall(p->pagetable, va, (uint64)mem, perm);
 }
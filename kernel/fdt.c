@@ -0,0 +1,138 @@
+//
+// Reading the flattened device tree that the boot firmware
+// (or qemu's reset code) passes to each hart in a1, to learn
+// how much RAM the machine has and how many harts.
+//
+// Hart 0 walks the tree's structure block once, in start(),
+// still in machine mode, while the other harts wait to learn
+// whether to run. Nothing is kept from it:
+// qemu puts the blob near the top of RAM, which kinit()
+// then hands out like any other memory.
+//
+// The format is described in the Devicetree Specification,
+// chapter 5. All numbers in the blob are big-endian.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+struct fdt_header {
+  uint magic;
+  uint totalsize;
+  uint off_dt_struct;     // offset of the structure block
+  uint off_dt_strings;    // offset of the property names
+  uint off_mem_rsvmap;
+  uint version;
+  uint last_comp_version;
+  uint boot_cpuid_phys;
+  uint size_dt_strings;
+  uint size_dt_struct;
+};
+
+// what the kernel assumes if there is no device tree.
+uint64 phystop = KERNBASE + 128*1024*1024;
+int ncpu = NCPU;
+
+static uint
+be32(void *p)
+{
+  uchar *b = p;
+
+  return (uint)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+// Read a number that takes up n 32-bit cells.
+static uint64
+cells(uint *p, int n)
+{
+  uint64 x = 0;
+
+  for(int i = 0; i < n; i++)
+    x = (x << 32) | be32(p + i);
+  return x;
+}
+
+// Set phystop to the end of the memory region the kernel
+// was loaded into, and ncpu to the number of harts, at most
+// NCPU, from the device tree at physical address pa, if
+// there is one. start() leaves any other harts idle.
+void
+fdtinit(uint64 pa)
+{
+  struct fdt_header *h = (struct fdt_header*)pa;
+  uint *p, *end, *val;
+  char *strings, *name, *prop;
+  int depth = 0, len, acells = 2, scells = 1;
+  int inmem = 0, incpus = 0, nharts = 0;
+  uint64 base, size, top = 0;
+
+  if(pa == 0 || be32(&h->magic) != FDT_MAGIC)
+    return;
+  p = (uint*)(pa + be32(&h->off_dt_struct));
+  end = (uint*)((char*)p + be32(&h->size_dt_struct));
+  strings = (char*)pa + be32(&h->off_dt_strings);
+
+  while(p < end){
+    switch(be32(p++)){
+    case FDT_BEGIN_NODE:
+      // the root is depth 1, /memory@... and /cpus depth 2.
+      name = (char*)p;
+      depth++;
+      if(depth == 2){
+        inmem = strncmp(name, "memory", 6) == 0 && (name[6] == 0 || name[6] == '@');
+        incpus = strncmp(name, "cpus", 5) == 0;
+      } else if(depth == 3 && incpus && strncmp(name, "cpu@", 4) == 0){
+        nharts++;
+      }
+      p += (strlen(name) + 4) / 4;  // with its NUL, padded
+      break;
+    case FDT_END_NODE:
+      if(--depth < 2)
+        inmem = incpus = 0;
+      break;
+    case FDT_PROP:
+      len = be32(p);
+      prop = strings + be32(p + 1);
+      val = p + 2;
+      p = val + (len + 3) / 4;
+      if(depth == 1 && strncmp(prop, "#address-cells", 15) == 0)
+        acells = be32(val);
+      else if(depth == 1 && strncmp(prop, "#size-cells", 12) == 0)
+        scells = be32(val);
+      else if(depth == 2 && inmem && strncmp(prop, "reg", 4) == 0){
+        for(; len >= 4*(acells + scells); len -= 4*(acells + scells)){
+          base = cells(val, acells);
+          size = cells(val + acells, scells);
+          val += acells + scells;
+          if(base <= KERNBASE && base + size > KERNBASE)
+            top = base + size;
+        }
+      }
+      break;
+    case FDT_NOP:
+      break;
+    case FDT_END:
+      p = end;
+      break;
+    default:
+      return;  // not a device tree we understand
+    }
+  }
+
+  if(top > PHYSMAX)
+    top = PHYSMAX;
+  if(top > KERNBASE)
+    phystop = PGROUNDDOWN(top);
+  if(nharts > 0)
+    ncpu = nharts < NCPU ? nharts : NCPU;
+}
@@ -6,9 +6,20 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: where readahead() expects the next read
+  uint rawin;        //   blocks to read ahead of it
+  uint raend;        //   first block not read ahead yet
   short major;       // FD_DEVICE
 };
 
+// The pages that MAP_SHARED mappings of a file, or of
+// one anonymous region, share; see mmap.c.
+struct shm {
+  struct spinlock lock;
+  int ref;                 // anonymous: regions using it
+  struct shmpage *pages;
+};
+
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
@@ -18,6 +29,8 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // processes running it as their program
+  struct inode *next; // Next in itable list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +39,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+NLEVEL];
+  struct textpage *text; // program pages shared by its processes
+  struct shm shm;     // pages shared by its MAP_SHARED mappings
+
+  uint goal;          // where to allocate its next block; 0 if no idea
 };
 
 // map major device number to device functions.
@@ -22,10 +22,14 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define RAMIN 4   // blocks readahead() first reads ahead of a sequential reader
+#define RAMAX 32  // most blocks it reads ahead
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +48,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -59,30 +65,111 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// bsum summarizes the free map in memory: how many blocks
+// each bitmap block has free, so that searches can pass
+// over full ones without reading them. A new block goes
+// next to a goal, normally just after the block allocated
+// last for the same file, so files end up contiguous.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+struct {
+  struct spinlock lock;
+  int *nfree;   // free blocks in each bitmap block; a hint
+  int nbmap;    // bitmap blocks
+  uint rotor;   // just after the block allocated last
+} bsum;
+
+// Count the free blocks in the free map.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int k, bi;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bsum.nbmap > PGSIZE / sizeof(int) || (bsum.nfree = kalloc()) == 0)
+    panic("bsuminit");
+  for(k = 0; k < bsum.nbmap; k++){
+    bsum.nfree[k] = 0;
+    bp = bread(dev, sb.bmapstart + k);
+    for(bi = 0; bi < BPB && k*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[k]++;
+    brelse(bp);
+  }
+  bsum.rotor = sb.size - sb.nblocks;  // the first data block
+}
+
+static void
+bsumadd(int k, int n)
+{
+  acquire(&bsum.lock);
+  bsum.nfree[k] += n;
+  release(&bsum.lock);
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+// Look for n free blocks in a row, at goal or after it,
+// going round the disk, and skipping the bitmap blocks that
+// haven't as many free. A run doesn't cross bitmap blocks.
+// If take is set, n must be 1: mark the block in use.
+// Returns the first block, or 0 if there is no such run.
+static uint
+bfind(uint dev, uint goal, int n, int take)
+{
+  struct buf *bp;
+  uint k, bi, from, to, run, b;
+
+  for(int i = 0; i <= bsum.nbmap; i++){
+    k = (goal / BPB + i) % bsum.nbmap;
+    from = i == 0 ? goal % BPB : 0;
+    to = i == bsum.nbmap ? goal % BPB : BPB;
+    if(k*BPB + to > sb.size)
+      to = sb.size - k*BPB;
+    if(from >= to || bsum.nfree[k] < n)
+      continue;
+    bp = bread(dev, sb.bmapstart + k);
+    for(run = 0, bi = from; bi < to; bi++){
+      if(bi % 8 == 0 && bi + 8 <= to && bp->data[bi/8] == 0xff){
+        run = 0;   // a byte's worth in use
+        bi += 7;
+        continue;
+      }
+      if(bp->data[bi/8] & (1 << (bi % 8))){
+        run = 0;
+        continue;
+      }
+      if(++run < n)
+        continue;
+      b = k*BPB + bi + 1 - n;
+      if(take){
+        bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
         log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        bsumadd(k, -1);
       }
+      brelse(bp);
+      return b;
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Allocate a zeroed disk block, the first free one
+// at goal or after it, or after the last one allocated
+// if goal is 0.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.rotor;
+  if((b = bfind(dev, goal, 1, 1)) == 0)
+    panic("balloc: out of blocks");
+  bsum.rotor = b + 1;
+  bzero(dev, b);
+  return b;
 }
 
 // Free a disk block.
@@ -100,6 +187,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  bsumadd(b / BPB, 1);
 }
 
 // Inodes.
@@ -167,27 +255,55 @@ bfree(int dev, uint b)
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
+// Entries are allocated from a slab cache and kept on a list.
+// Up to NINODE unreferenced entries stay cached for reuse;
+// beyond that, iput() frees an entry when its last reference
+// goes away.
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// Text pages: the pages of a program file that exec'd
+// processes have faulted in are cached in ip->text, and
+// the same physical page is mapped into every process
+// running the program (see itextpage()). The cache holds
+// one reference to each page. It is dropped when the file
+// is written or truncated, and when the last reference to
+// the inode goes away. ip->nexec counts the processes
+// running the program; while there are any, the file can't
+// be opened for writing, truncated, or written, so that
+// their pages always match it.
+//
+// ip->shm holds the pages of the file's MAP_SHARED mappings
+// (see mmap.c); writei() copies what it writes into them too.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *head;
+  int nfree;     // entries with ref == 0
 } itable;
 
+struct textpage {
+  struct textpage *next;
+  uint off;      // file offset of the page
+  uint n;        // bytes from the file; the rest is zero
+  char *pa;
+};
+
+static struct kmem_cache *textcache;
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+  textcache = kmem_cache_create("textpage", sizeof(struct textpage));
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void itextfree(struct inode *ip);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -248,9 +364,10 @@ iget(uint dev, uint inum)
 
   // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        itable.nfree--;
       release(&itable.lock);
       return ip;
     }
@@ -258,15 +375,25 @@ iget(uint dev, uint inum)
       empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  if(empty){
+    // Recycle an inode entry.
+    ip = empty;
+    itable.nfree--;
+  } else {
+    if((ip = kmem_cache_alloc(itable.cache)) == 0)
+      panic("iget: no inodes");
+    initsleeplock(&ip->lock, "inode");
+    ip->text = 0;
+    shminit(&ip->shm);
+    ip->next = itable.head;
+    itable.head = ip;
+  }
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
+  ip->nexec = 0;
   ip->valid = 0;
+  ip->goal = 0;
   release(&itable.lock);
 
   return ip;
@@ -332,6 +459,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -354,6 +483,18 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    itextfree(ip);
+    shmfree(&ip->shm);
+    if(itable.nfree < NINODE){
+      itable.nfree++;
+    } else {
+      for(pp = &itable.head; *pp != ip; pp = &(*pp)->next)
+        ;
+      *pp = ip->next;
+      kmem_cache_free(itable.cache, ip);
+    }
+  }
   release(&itable.lock);
 }
 
@@ -370,38 +511,99 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// are listed in the blocks listed in ip->addrs[NDIRECT+1],
+// a double-indirect block, and the next NTINDIRECT below
+// the triple-indirect block ip->addrs[NDIRECT+2].
+
+// Allocate a block for ip, right after the one
+// allocated for it last if that one is free.
+static uint
+bnew(struct inode *ip)
+{
+  uint b = balloc(ip->dev, ip->goal);
+
+  ip->goal = b + 1;
+  return b;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one if alloc is
+// set, and otherwise returns 0.
 static uint
-bmap(struct inode *ip, uint bn)
+bwalk(struct inode *ip, uint bn, int alloc)
 {
-  uint addr, *a;
+  uint addr, *a, n, level;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = bnew(ip);
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  // which tree of indirect blocks is it in?
+  for(level = 1, n = NINDIRECT; bn >= n; level++, n *= NINDIRECT){
+    if(level == NLEVEL)
+      panic("bmap: out of range");
+    bn -= n;
+  }
+
+  // Load indirect blocks, allocating if necessary.
+  if((addr = ip->addrs[NDIRECT+level-1]) == 0){
+    if(!alloc)
+      return 0;
+    ip->addrs[NDIRECT+level-1] = addr = bnew(ip);
+  }
+  for(; level > 0; level--){
+    n /= NINDIRECT;  // blocks below each entry
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    if((addr = a[bn / n]) == 0 && alloc){
+      a[bn / n] = addr = bnew(ip);
       log_write(bp);
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    bn %= n;
   }
+  return addr;
+}
+
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  return bwalk(ip, bn, 1);
+}
+
+// Like bmap(), but returns 0 instead of allocating
+// a block that isn't there.
+static uint
+bmapped(struct inode *ip, uint bn)
+{
+  return bwalk(ip, bn, 0);
+}
+
+// Free the indirect block addr, and the blocks below it,
+// level levels down.
+static void
+itruncind(struct inode *ip, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
 
-  panic("bmap: out of range");
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(int j = 0; j < NINDIRECT; j++){
+    if(a[j] && level > 1)
+      itruncind(ip, a[j], level - 1);
+    else if(a[j])
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
 }
 
 // Truncate inode (discard contents).
@@ -409,9 +611,9 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  itextfree(ip);
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -420,19 +622,15 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < NLEVEL; i++){
+    if(ip->addrs[NDIRECT+i]){
+      itruncind(ip, ip->addrs[NDIRECT+i], i + 1);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
   ip->size = 0;
+  ip->goal = 0;
   iupdate(ip);
 }
 
@@ -448,6 +646,47 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks of f's inode after a read of n
+// bytes at f->off, if it carries on where f's last read
+// stopped: the window of blocks to read ahead doubles each
+// time, up to RAMAX, and halves when a read jumps elsewhere.
+// The state is per open file, so that readers of the same
+// file at different places don't spoil each other's.
+// Caller must hold f->ip->lock.
+void
+readahead(struct file *f, uint n)
+{
+  struct inode *ip = f->ip;
+  uint blocks[RAMAX], bn, end, addr, off = f->off;
+  int m = 0;
+
+  if(off >= ip->size)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+  if(off != f->raoff){
+    f->rawin /= 2;
+    f->raend = 0;
+    f->raoff = off + n;
+    return;
+  }
+  f->raoff = off + n;
+  f->rawin = f->rawin ? min(2*f->rawin, RAMAX) : RAMIN;
+
+  bn = off / BSIZE;
+  if(bn < f->raend)
+    bn = f->raend;
+  end = (off + n + BSIZE - 1) / BSIZE + f->rawin;
+  end = min(end, (ip->size + BSIZE - 1) / BSIZE);
+  for(; bn < end && m < RAMAX; bn++){
+    if((addr = bmapped(ip, bn)) == 0)
+      break;
+    blocks[m++] = addr;
+  }
+  f->raend = bn;
+  breada(ip->dev, blocks, m);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -476,6 +715,24 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Before a write of n bytes at off, which may add blocks
+// to the end of ip, aim its goal at a run of free blocks
+// long enough for them all, so that they end up together.
+static void
+bplace(struct inode *ip, uint off, uint n)
+{
+  uint first = (ip->size + BSIZE - 1) / BSIZE;  // first block not allocated
+  uint last = (off + n - 1) / BSIZE;
+  uint b;
+
+  if(n == 0 || last < first)
+    return;
+  if(ip->goal == 0 && first > 0 && (b = bmapped(ip, first - 1)) != 0)
+    ip->goal = b + 1;
+  if(last > first && (b = bfind(ip->dev, ip->goal ? ip->goal : bsum.rotor, last - first + 1, 0)) != 0)
+    ip->goal = b;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -493,6 +750,13 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->nexec > 0)
+    return -1;  // a running program
+
+  // nothing runs the program now, but the text cache may
+  // still hold its old pages from an earlier run.
+  itextfree(ip);
+  bplace(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -501,6 +765,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    shmwrite(&ip->shm, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -516,6 +781,76 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Return a page holding the n bytes of ip at off,
+// followed by zeros, and take a reference to it for
+// the caller; the page must not be written while
+// anyone else may hold a reference. The page comes
+// from ip's text cache, or is read in and added to it.
+// Returns 0 if out of memory or the read fails.
+// Caller must hold ip->lock.
+char*
+itextpage(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t;
+  char *pa;
+
+  for(t = ip->text; t; t = t->next){
+    if(t->off == off && t->n == n){
+      kref(t->pa);
+      return t->pa;
+    }
+  }
+
+  if((pa = kalloc_zeroed()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)pa, off, n) != n){
+    kfree(pa);
+    return 0;
+  }
+  if((t = kmem_cache_alloc(textcache)) != 0){
+    t->off = off;
+    t->n = n;
+    t->pa = pa;
+    t->next = ip->text;
+    ip->text = t;
+    kref(pa);
+  }
+  return pa;
+}
+
+// Count one more process running the program in ip.
+// The first must be counted with ip->lock held, so
+// that writei() and open() see it; after that the
+// caller only needs to hold a counted reference.
+void
+iexec(struct inode *ip)
+{
+  __sync_fetch_and_add(&ip->nexec, 1);
+}
+
+// Stop counting a process running the program in ip,
+// and drop its reference to ip.
+void
+iexecput(struct inode *ip)
+{
+  __sync_fetch_and_sub(&ip->nexec, 1);
+  iput(ip);
+}
+
+// Drop ip's text cache. Caller must hold ip->lock,
+// or have the only reference to ip.
+static void
+itextfree(struct inode *ip)
+{
+  struct textpage *t;
+
+  while((t = ip->text) != 0){
+    ip->text = t->next;
+    kfree(t->pa);
+    kmem_cache_free(textcache, t);
+  }
+}
+
 // Directories
 
 int
@@ -1,6 +1,11 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// A binary buddy allocator: hands out physically contiguous,
+// naturally aligned blocks of 2^order pages, for orders
+// 0 (4096 bytes) up to MAXORDER (2 MB). kalloc() and kfree()
+// are the order-0 special case.
 
 #include "types.h"
 #include "param.h"
@@ -8,75 +13,399 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
-void freerange(void *pa_start, void *pa_end);
+// how many pre-zeroed pages the idle loop keeps on hand.
+#define NZEROPOOL 128
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// a free block; lives in the block's first page.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// per-page book-keeping, indexed by (pa - KERNBASE) / PGSIZE.
+// only meaningful for the first page of a block.
+struct pageinfo {
+  uchar order;  // size of the block starting here
+  uchar free;   // is the block on a free list?
+  ushort ref;   // references to an allocated block
+};
+
+// Pages that have never been handed out are not on any
+// free list; they are described by the range [next, top)
+// and carved off in aligned blocks when the free lists run dry.
+// This keeps kinit() from touching every page of RAM at boot.
+// Everything in [start, next) has valid pageinfo.
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1];  // circular lists, one per order.
+  int nfree[MAXORDER+1];        // length of each list.
+  struct pageinfo *pages;
+  char *start;          // first page managed by the allocator.
+  char *next;           // first never-allocated page.
+  char *top;            // end of the never-allocated range.
+  struct run *zeroed;   // pages already filled with zeros.
+  int nzeroed;          // length of the zeroed list.
 } kmem;
 
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)  ((char*)(KERNBASE + (uint64)(i) * PGSIZE))
+
 void
 kinit()
 {
+  uint64 npages, sz;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int k = 0; k <= MAXORDER; k++){
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
+    kmem.nfree[k] = 0;
+  }
+
+  // the pageinfo array sits right after the kernel.
+  npages = PA2IDX(PHYSTOP);
+  sz = PGROUNDUP(npages * sizeof(struct pageinfo));
+  kmem.pages = (struct pageinfo*)PGROUNDUP((uint64)end);
+  kmem.start = (char*)kmem.pages + sz;
+  kmem.next = kmem.start;
+  kmem.top = (char*)PHYSTOP;
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+static void
+push(struct run *r, int order)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct run *h = &kmem.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.nfree[order]++;
+  kmem.pages[PA2IDX(r)].order = order;
+  kmem.pages[PA2IDX(r)].free = 1;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void
-kfree(void *pa)
+static void
+unlink(struct run *r, int order)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[order]--;
+  kmem.pages[PA2IDX(r)].free = 0;
+}
+
+// Move the largest aligned block at the start of the
+// never-allocated range onto a free list.
+// Returns 0 if the range is used up.
+// Caller must hold kmem.lock.
+static int
+carve(void)
+{
+  uint64 i = PA2IDX(kmem.next);
+  int order = 0;
+
+  if(kmem.next + PGSIZE > kmem.top)
+    return 0;
+  while(order < MAXORDER && (i & (1L << order)) == 0 &&
+        kmem.next + (PGSIZE << (order+1)) <= kmem.top)
+    order++;
+  kmem.next += PGSIZE << order;
+  push((struct run*)IDX2PA(i), order);
+  return 1;
+}
+
+// Take a block of 2^order pages off the free lists,
+// splitting a bigger block if need be.
+// Caller must hold kmem.lock.
+static struct run*
+bpop(int order)
 {
   struct run *r;
+  int k;
+
+  for(;;){
+    for(k = order; k <= MAXORDER; k++)
+      if(kmem.nfree[k] > 0)
+        break;
+    if(k <= MAXORDER)
+      break;
+    if(!carve())
+      return 0;
+  }
+
+  r = kmem.free[k].next;
+  unlink(r, k);
+  // return the upper halves to the free lists.
+  while(k > order){
+    k--;
+    push((struct run*)((char*)r + (PGSIZE << k)), k);
+  }
+  kmem.pages[PA2IDX(r)].order = order;
+  kmem.pages[PA2IDX(r)].ref = 1;
+  return r;
+}
+
+// Put a block back, merging it with its buddy
+// for as long as the buddy is free too.
+// Caller must hold kmem.lock.
+static void
+bpush(char *pa, int order)
+{
+  uint64 i = PA2IDX(pa), b;
+  uint64 lo = PA2IDX(kmem.start), hi = PA2IDX(kmem.next);
+
+  while(order < MAXORDER){
+    b = i ^ (1L << order);
+    if(b < lo || b >= hi || !kmem.pages[b].free || kmem.pages[b].order != order)
+      break;
+    unlink((struct run*)IDX2PA(b), order);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  push((struct run*)IDX2PA(i), order);
+}
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+// Drop a reference to the block of 2^order pages at pa,
+// which must have been returned by kalloc_pages(order),
+// and free it if that was the last one.
+void
+kfree_pages(void *pa, int order)
+{
+  struct pageinfo *pi;
+
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < kmem.start ||
+     (char*)pa + (PGSIZE << order) > kmem.next)
     panic("kfree");
 
+  acquire(&kmem.lock);
+  pi = &kmem.pages[PA2IDX(pa)];
+  if(order > 0 && !pi->free && pi->order == 0){
+    // ksplit() broke the block up; drop each page.
+    release(&kmem.lock);
+    for(int i = 0; i < (1 << order); i++)
+      kfree_pages((char*)pa + i*PGSIZE, 0);
+    return;
+  }
+  if(pi->free || pi->order != order || pi->ref < 1)
+    panic("kfree: bad block");
+  if(--pi->ref > 0){
+    release(&kmem.lock);
+    return;
+  }
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  memset(pa, 1, PGSIZE << order);
+#endif
+  bpush(pa, order);
+  release(&kmem.lock);
+}
+
+// Take another reference to the 2^order pages at pa,
+// e.g. to share them between two page tables: one to
+// the block, or one to each page if ksplit() broke
+// the block up. kfree_pages() drops references.
+void
+kref_pages(void *pa, int order)
+{
+  uint64 i = PA2IDX(pa);
+  int n = 1;
+
+  acquire(&kmem.lock);
+  if(kmem.pages[i].order != order)
+    n = 1 << order;  // split
+  for(; n > 0; n--, i++){
+    if(kmem.pages[i].ref < 1)
+      panic("kref");
+    kmem.pages[i].ref++;
+  }
+  release(&kmem.lock);
+}
+
+void
+kref(void *pa)
+{
+  kref_pages(pa, 0);
+}
+
+// Turn the allocated block of 2^order pages at pa into
+// 2^order separate pages, each with the block's
+// references, so that they can be freed one at a time,
+// e.g. when a megapage mapping is broken up.
+// Does nothing if the block was already split.
+void
+ksplit(void *pa, int order)
+{
+  struct pageinfo *pi = &kmem.pages[PA2IDX(pa)];
+
+  acquire(&kmem.lock);
+  if(pi->free || pi->ref < 1 || (pi->order != order && pi->order != 0))
+    panic("ksplit");
+  for(int i = 1; pi->order == order && i < (1 << order); i++){
+    pi[i].order = 0;
+    pi[i].free = 0;
+    pi[i].ref = pi->ref;
+  }
+  pi->order = 0;
+  release(&kmem.lock);
+}
 
-  r = (struct run*)pa;
+// Number of references to an allocated block.
+int
+krefcnt(void *pa)
+{
+  int n;
+
+  acquire(&kmem.lock);
+  n = kmem.pages[PA2IDX(pa)].ref;
+  release(&kmem.lock);
+  return n;
+}
+
+// Allocate a physically contiguous block of 2^order pages,
+// aligned to its size. Returns 0 if no such block is free.
+void *
+kalloc_pages(int order)
+{
+  struct run *r, *z;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages");
 
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  r = bpop(order);
+  if(r == 0 && order > 0 && kmem.zeroed){
+    // the zeroed pool may be what keeps buddies apart.
+    while((z = kmem.zeroed) != 0){
+      kmem.zeroed = z->next;
+      bpush((char*)z, 0);
+    }
+    kmem.nzeroed = 0;
+    r = bpop(order);
+  }
   release(&kmem.lock);
+
+  if(r == 0 && (slab_reclaim() > 0 || breclaim(1 << order) > 0))
+    return kalloc_pages(order);
+
+#ifdef KALLOC_DEBUG
+  if(r)
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Free the page of physical memory pointed at by pa,
+// which normally should have been returned by a
+// call to kalloc().
+void
+kfree(void *pa)
+{
+  kfree_pages(pa, 0);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The contents of the page are undefined; use
+// kalloc_zeroed() if the caller needs zeros.
 void *
 kalloc(void)
 {
   struct run *r;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = bpop(0);
+  if(r == 0 && (r = kmem.zeroed) != 0){
+    // out of ordinary pages; dip into the zeroed pool.
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+  }
   release(&kmem.lock);
 
+  // slab caches may be sitting on empty pages,
+  // and the buffer cache on unused ones.
+  if(r == 0 && (slab_reclaim() > 0 || breclaim(8) > 0))
+    return kalloc();
+
+#ifdef KALLOC_DEBUG
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one zero-filled 4096-byte page.
+// Takes a page from the pool that the scheduler fills
+// when idle, and only clears a page inline
+// when the pool is empty.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  r = kmem.zeroed;
+  if(r){
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+    release(&kmem.lock);
+    r->next = 0; // the link was the only non-zero word.
+    return (void*)r;
+  }
+  release(&kmem.lock);
+
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
+
+// Called by the scheduler when it finds nothing to run.
+// Moves one page from the free lists to the zeroed pool,
+// clearing it on the way, so that zeroing only ever uses
+// time no thread wants. Returns 0 if the pool is full or
+// there is no free page to move.
+int
+kzeroidle(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  r = 0;
+  if(kmem.nzeroed < NZEROPOOL)
+    r = bpop(0);
+  release(&kmem.lock);
+  if(r == 0)
+    return 0;
+
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zeroed;
+  kmem.zeroed = r;
+  kmem.nzeroed++;
+  release(&kmem.lock);
+  return 1;
+}
+
+// Fill in allocator statistics for the memstat system call.
+// Never-allocated pages count as free order-0 pages; they
+// would be carved into blocks as large as possible on demand.
+void
+kmemstat(struct memstat *st)
+{
+  acquire(&kmem.lock);
+  st->npages = (kmem.top - kmem.start) / PGSIZE;
+  st->nfree = (kmem.top - kmem.next) / PGSIZE + kmem.nzeroed;
+  st->nzeroed = kmem.nzeroed;
+  st->nuncarved = (kmem.top - kmem.next) / PGSIZE;
+  for(int k = 0; k <= MAXORDER; k++){
+    st->nblocks[k] = kmem.nfree[k];
+    st->nfree += kmem.nfree[k] << k;
+  }
+  release(&kmem.lock);
+}
@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are
+// no FS system calls in it still active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,7 +19,20 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction has been closed. Each
+// operation reserves room in the log for the blocks it
+// may write: MAXOPBLOCKS, or as many as begin_opn() says.
+//
+// Commits are grouped: the kflushd kernel process closes the
+// open transaction a tick after its first write, or sooner if
+// begin_op() or sync() asks. Closing waits for the system
+// calls still in the transaction to end, and then copies its
+// blocks out of the buffer cache, so that the next transaction
+// can start while kflushd writes this one to the log, commits
+// it, and installs it. So there are two transactions in
+// memory: the open one, and the one kflushd is writing.
+// begin_op() waits for the disk only when the open transaction
+// is full while kflushd is still writing the previous one.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,86 +41,141 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// mkfs decides how many blocks the log has, and the
+// super block says; up to MAXLOG, and the header.
+
+#define GROUPTICKS 1  // ticks a transaction stays open for more system calls
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOG];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in the log, with the header.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may yet write.
+  int closing;     // kflushd is closing the transaction, please wait.
+  int want;        // close the transaction now, don't wait for the timer.
+  uint opened;     // ticks when the transaction's first block was logged.
+  int nclosed;     // transactions closed so far.
+  int ncommit;     // transactions committed and installed so far.
   int dev;
   struct logheader lh;
+
+  // the closed transaction that kflushd is writing.
+  struct logheader ck;
+  struct buf *ckbuf[MAXLOG];  // cached blocks, pinned and dirty.
+  struct buf copy[MAXLOG];    // copies of them, taken when it closed.
+  struct buf *io[MAXLOG];     // copies to read or write, for kflushd.
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
+  char *mem;
+  int n = sb->nlog - 1;
+
+  if (sizeof(struct logheader) > BSIZE)
     panic("initlog: too big logheader");
+  if (n > MAXLOG || n < 2*MAXOPBLOCKS)
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
+  for (int i = 0; i < n; i += PGSIZE/BSIZE) {
+    if ((mem = kalloc()) == 0)
+      panic("initlog: no memory");
+    for (int j = 0; j < PGSIZE/BSIZE && i+j < n; j++)
+      log.copy[i+j].data = (uchar*)mem + j*BSIZE;
+  }
   log.start = sb->logstart;
-  log.size = sb->nlog;
   log.dev = dev;
   recover_from_log();
+  __sync_synchronize();
+  log.size = sb->nlog;  // kflushd waits for this
 }
 
-// Copy committed blocks from log to their home location
+// Read or write the n blocks of the log (not the header)
+// from or to the copies. They are consecutive, so the
+// disk gets them in a few large requests.
 static void
-install_trans(int recovering)
+log_rw(int n, int write)
 {
+  struct buf **bs = log.io;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < n; tail++) {
+    bs[tail] = &log.copy[tail];
+    bs[tail]->dev = log.dev;
+    bs[tail]->blockno = log.start+tail+1;
   }
+  virtio_disk_start(bs, n, write);
+  for (tail = 0; tail < n; tail++)
+    virtio_disk_wait(bs[tail]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Write the copies of the blocks of the transaction
+// in log.ck to their home locations, all in one batch,
+// in block order so that runs of consecutive blocks go
+// in one disk request each. The cached blocks may be
+// newer, changed by the transaction that is open now.
+static void
+install_trans(void)
+{
+  struct buf **bs = log.io, *b;
+  int tail, i, n = log.ck.n;
+
+  for (tail = 0; tail < n; tail++) {
+    b = &log.copy[tail];
+    b->blockno = log.ck.block[tail];
+    for (i = tail; i > 0 && bs[i-1]->blockno > b->blockno; i--)
+      bs[i] = bs[i-1];
+    bs[i] = b;
+  }
+  virtio_disk_start(bs, n, 1);
+  for (tail = 0; tail < n; tail++)
+    virtio_disk_wait(bs[tail]);
+  for (tail = 0; tail < n; tail++) {
+    if (log.ckbuf[tail]) {
+      bclean(log.ckbuf[tail]);
+      log.ckbuf[tail] = 0;
+    }
+  }
+}
+
+// Read the log header from disk into log.ck.
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.ck.n = lh->n;
+  for (i = 0; i < log.ck.n; i++) {
+    log.ck.block[i] = lh->block[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write log.ck's header to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.ck.n;
+  for (i = 0; i < log.ck.n; i++) {
+    hb->block[i] = log.ck.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -117,94 +185,174 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  log_rw(log.ck.n, 0);
+  install_trans(); // if committed, copy from log to disk
+  log.ck.n = 0;
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call
+// that may write up to n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
   acquire(&log.lock);
+  if(n > log.size - 1)
+    panic("begin_op: too big");
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + n > log.size - 1){
+      // this op might exhaust log space; wait for the
+      // transaction to close.
+      log.want = 1;
+      wakeup(&log.lh);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the end of each FS system call,
+// with what it passed to begin_opn().
 void
-end_op(void)
+end_opn(int n)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  log.reserved -= n;
+  if(log.outstanding == 0 && log.closing){
+    // kflushd is waiting for the transaction to quiesce.
+    wakeup(&log.lh);
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
+    // and decrementing log.reserved has decreased
     // the amount of reserved space.
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
 }
 
-// Copy modified blocks from cache to log.
+// The most blocks one operation should reserve: half
+// the log, so that others can go on at the same time.
+int
+log_maxop(void)
+{
+  return (log.size - 1) / 2;
+}
+
+// Close the open transaction: wait for its system calls
+// to end, then copy its blocks from the cache into log.ck.
+// The cached blocks stay pinned, marked dirty, until
+// install_trans() writes them home.
+// Called by kflushd with log.lock held; returns without it.
 static void
-write_log(void)
+close_trans(void)
 {
-  int tail;
+  log.closing = 1;
+  while(log.outstanding > 0)
+    sleep(&log.lh, &log.lock);
+  log.ck = log.lh;
+  log.lh.n = 0;
+  log.want = 0;
+  release(&log.lock);
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  // nothing can change the blocks while closing is set.
+  for (int tail = 0; tail < log.ck.n; tail++) {
+    struct buf *from = bread(log.dev, log.ck.block[tail]); // cache block
+    memmove(log.copy[tail].data, from->data, BSIZE);
+    bdirty(from);
+    log.ckbuf[tail] = from;
     brelse(from);
-    brelse(to);
   }
+
+  acquire(&log.lock);
+  log.closing = 0;
+  log.nclosed++;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  if (log.ck.n > 0) {
+    log_rw(log.ck.n, 1);  // Write copies of modified blocks to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
+    install_trans(); // Now install writes to home locations
+    acquire(&log.lock);
+    log.ncommit++;
+    wakeup(&log);
+    release(&log.lock);
+    log.ck.n = 0;
     write_head();    // Erase the transaction from the log
   }
 }
 
+// Wait until the operations that have finished so far
+// are committed and written to their home locations.
+void
+log_sync(void)
+{
+  int want;
+
+  acquire(&log.lock);
+  want = log.nclosed;  // the one kflushd is committing, if any
+  if (log.lh.n > 0 || log.closing) {
+    want = log.nclosed + 1;
+    log.want = 1;
+    wakeup(&log.lh);
+  }
+  while (log.ncommit < want)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// Body of the kflushd kernel process.
+// Closes the open transaction once it has been open
+// for GROUPTICKS, or when asked to, and commits it.
+void
+kflushd(void)
+{
+  for(;;){
+    if(log.size == 0 || (log.lh.n > 0 && !log.want && ticks - log.opened < GROUPTICKS)){
+      // the file system isn't mounted yet, or the
+      // transaction may get more system calls.
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+      continue;
+    }
+    acquire(&log.lock);
+    if(log.lh.n == 0){
+      sleep(&log.lh, &log.lock);
+      release(&log.lock);
+      continue;
+    }
+    close_trans();
+    commit();
+  }
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// kflushd's commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +365,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -229,8 +377,10 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    if (log.lh.n++ == 0) {
+      log.opened = ticks;
+      wakeup(&log.lh);  // start kflushd's timer
+    }
   }
   release(&log.lock);
 }
-
@@ -6,19 +6,27 @@
 
 volatile static int started = 0;
 
+// qemu's time counter runs at 10 MHz.
+#define TICKS_PER_US 10
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
 {
   if(cpuid() == 0){ 
+    uint64 t0 = r_time(), tk;
     consoleinit();
     printfinit();
     printf("\n");
-    printf("xv6 kernel is booting\n");
+    printf("xv6 kernel is booting: %d harts, %d MB\n",
+           ncpu, (int)((PHYSTOP - KERNBASE) >> 20));
     printf("\n");
+    tk = r_time();
     kinit();         // physical page allocator
+    tk = r_time() - tk;
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    slabinit();      // small-object allocator
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -27,8 +35,14 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe buffers
+    vmainit();       // shared mappings
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kproc_create(kswapd, "kswapd"); // swap out cold pages
+    kproc_create(kflushd, "kflushd"); // write committed blocks home
+    printf("boot: kinit %d us, hart 0 init %d us\n",
+           (int)(tk / TICKS_PER_US), (int)((r_time() - t0) / TICKS_PER_US));
     __sync_synchronize();
     started = 1;
   } else {
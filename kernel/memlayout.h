@@ -15,7 +15,7 @@
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
-// PHYSTOP -- end RAM used by the kernel
+// PHYSTOP -- end RAM used by the kernel, as the device tree says
 
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
@@ -43,9 +43,12 @@
 
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
-// from physical address 0x80000000 to PHYSTOP.
+// from physical address 0x80000000 to PHYSTOP,
+// which fdtinit() learns from the device tree,
+// up to PHYSMAX.
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
+#define PHYSTOP phystop
+#define PHYSMAX (KERNBASE + 64L*1024*1024*1024)
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -0,0 +1,14 @@
+// Physical memory statistics, filled in by the memstat system call.
+struct memstat {
+  uint64 npages;              // Pages managed by the allocator
+  uint64 nfree;               // Free pages, in any block or pool
+  uint64 nzeroed;             // Free pages already zero-filled
+  uint64 nuncarved;           // Free pages never yet handed out
+  uint64 nblocks[MAXORDER+1]; // Free blocks of each order
+  uint64 nswap;               // Pages of swap space
+  uint64 nswapped;            // Pages of it in use
+  uint64 nbuf;                // Blocks the buffer cache can hold
+  uint64 nbufhit;             // Buffer cache lookups that hit
+  uint64 nbufmiss;            // and that missed
+  uint64 nbufahead;           // Blocks asked to be read ahead
+};
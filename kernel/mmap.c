@@ -0,0 +1,596 @@
+//
+// Memory-mapped files and anonymous memory: mmap() and munmap().
+//
+// Each process has a small table of regions (struct vma),
+// placed top-down below the trapframe. Nothing is read
+// when a region is created; vmfault() sends faults above
+// p->sz to vmafault(), which reads the page from the file,
+// or zero-fills it for MAP_ANONYMOUS.
+// Pages of MAP_SHARED regions that the process wrote to
+// are written back through the log when they are unmapped,
+// by munmap(), exec() or exit().
+//
+// A MAP_SHARED region's pages live in a struct shm: the
+// file's ip->shm, or, for MAP_ANONYMOUS, one allocated by
+// mmap() and shared with the region's copies in children.
+// vmafault() takes a page from there, or reads it in and
+// adds it, so every process mapping the same page gets the
+// same physical page, whether it faults before or after a
+// fork(). The shm holds a reference to each of its pages,
+// so they are never swapped out. An inode's shm drops a
+// page once no process maps it, as its contents are then
+// on disk, unless writing it back failed; an anonymous shm
+// keeps its pages until the last region using it is
+// unmapped.
+//
+// p->lock protects p->vmas. Region contents are read and
+// written without it, since that involves the disk.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// A page of a struct shm.
+struct shmpage {
+  struct shmpage *next;
+  uint off;      // offset in the file or anonymous region
+  char *pa;
+  int dirty;     // writing it back to the file failed
+};
+
+static struct kmem_cache *shmcache;
+static struct kmem_cache *shmpagecache;
+
+void
+vmainit(void)
+{
+  shmcache = kmem_cache_create("shm", sizeof(struct shm));
+  shmpagecache = kmem_cache_create("shmpage", sizeof(struct shmpage));
+}
+
+void
+shminit(struct shm *s)
+{
+  initlock(&s->lock, "shm");
+  s->ref = 0;
+  s->pages = 0;
+}
+
+// Return s's page at off, with a reference for
+// the caller, or 0 if s doesn't have it yet.
+static char*
+shmget(struct shm *s, uint off)
+{
+  struct shmpage *sp;
+  char *pa = 0;
+
+  acquire(&s->lock);
+  for(sp = s->pages; sp; sp = sp->next){
+    if(sp->off == off){
+      pa = sp->pa;
+      kref(pa);
+      break;
+    }
+  }
+  release(&s->lock);
+  return pa;
+}
+
+// Add the caller's page pa to s at off, unless another
+// process has added one meanwhile; then use that one
+// instead, and free pa. Returns the page, with the
+// caller's reference, or 0 if out of memory.
+static char*
+shmadd(struct shm *s, uint off, char *pa)
+{
+  struct shmpage *sp, *nsp;
+
+  nsp = kmem_cache_alloc(shmpagecache);
+  acquire(&s->lock);
+  for(sp = s->pages; sp; sp = sp->next)
+    if(sp->off == off)
+      break;
+  if(sp){
+    kref(sp->pa);
+    release(&s->lock);
+    kfree(pa);
+    if(nsp)
+      kmem_cache_free(shmpagecache, nsp);
+    return sp->pa;
+  }
+  if(nsp == 0){
+    release(&s->lock);
+    kfree(pa);
+    return 0;
+  }
+  nsp->off = off;
+  nsp->pa = pa;
+  nsp->dirty = 0;
+  nsp->next = s->pages;
+  s->pages = nsp;
+  kref(pa);
+  release(&s->lock);
+  return pa;
+}
+
+// Copy n bytes from src into s's page holding off,
+// if it has one. The bytes must not cross a page.
+// writei() calls this for every block it writes.
+void
+shmwrite(struct shm *s, uint off, char *src, uint n)
+{
+  struct shmpage *sp;
+
+  acquire(&s->lock);
+  for(sp = s->pages; sp; sp = sp->next){
+    if(sp->off == PGROUNDDOWN(off)){
+      memmove(sp->pa + off % PGSIZE, src, n);
+      break;
+    }
+  }
+  release(&s->lock);
+}
+
+// Mark s's page at off as not written back, so that
+// shmdrop() keeps it until it is.
+static void
+shmsetdirty(struct shm *s, uint off)
+{
+  struct shmpage *sp;
+
+  acquire(&s->lock);
+  for(sp = s->pages; sp; sp = sp->next)
+    if(sp->off == off)
+      sp->dirty = 1;
+  release(&s->lock);
+}
+
+// Return a page of s marked dirty, at an offset of at
+// least from, with a reference for the caller, and set
+// *off to its offset; clear the mark. 0 if there is none.
+static char*
+shmtakedirty(struct shm *s, uint from, uint *off)
+{
+  struct shmpage *sp, *best = 0;
+  char *pa = 0;
+
+  acquire(&s->lock);
+  for(sp = s->pages; sp; sp = sp->next)
+    if(sp->dirty && sp->off >= from && (best == 0 || sp->off < best->off))
+      best = sp;
+  if(best){
+    best->dirty = 0;
+    pa = best->pa;
+    *off = best->off;
+    kref(pa);
+  }
+  release(&s->lock);
+  return pa;
+}
+
+// Drop s's pages. If all is 0, only those that no
+// process maps and that don't wait to be written back.
+static void
+shmdrop(struct shm *s, int all)
+{
+  struct shmpage **pp, *sp;
+
+  acquire(&s->lock);
+  for(pp = &s->pages; (sp = *pp) != 0; ){
+    if(all || (krefcnt(sp->pa) == 1 && !sp->dirty)){
+      *pp = sp->next;
+      kfree(sp->pa);
+      kmem_cache_free(shmpagecache, sp);
+    } else {
+      pp = &sp->next;
+    }
+  }
+  release(&s->lock);
+}
+
+// Drop all of s's pages, when its inode goes away.
+void
+shmfree(struct shm *s)
+{
+  shmdrop(s, 1);
+}
+
+// References held by regions: to the file, if any,
+// and to an anonymous region's shm.
+static void
+vmadup(struct vma *v)
+{
+  if(v->f)
+    filedup(v->f);
+  if(v->shm && v->f == 0){
+    acquire(&v->shm->lock);
+    v->shm->ref++;
+    release(&v->shm->lock);
+  }
+}
+
+static void
+vmaclose(struct vma *v)
+{
+  int ref;
+
+  if(v->shm && v->f == 0){
+    acquire(&v->shm->lock);
+    ref = --v->shm->ref;
+    release(&v->shm->lock);
+    if(ref == 0){
+      shmdrop(v->shm, 1);
+      kmem_cache_free(shmcache, v->shm);
+    }
+  }
+  if(v->f)
+    fileclose(v->f);
+}
+
+// Find the region containing va.
+// Caller must hold p->lock.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by any region, or the trapframe if none.
+// The heap may not grow past it.
+// Caller must hold p->lock.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME(0);
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->len && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Find room for len bytes: the highest gap below
+// the trapframe and above the heap. Returns 0 if none.
+// Caller must hold p->lock.
+static uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 top = TRAPFRAME(0);
+
+ again:
+  if(top < len || top - len < PGROUNDUP(p->sz))
+    return 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->len && v->addr < top && v->addr + v->len > top - len){
+      top = v->addr;
+      goto again;
+    }
+  }
+  return top - len;
+}
+
+static int
+vmaperm(int prot)
+{
+  int perm = PTE_U;
+
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;  // W without R is reserved.
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Map len bytes of f, starting at offset off, somewhere
+// in the current process; with MAP_ANONYMOUS, f is 0 and
+// the memory starts out zeroed. addr is only a hint, and
+// is ignored. Returns the address, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv = 0;
+  struct shm *shm = 0;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+    off = 0;
+  } else if(f == 0 || f->type != FD_INODE || !f->readable){
+    return -1;
+  } else if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable){
+    return -1;
+  }
+  len = PGROUNDUP(len);
+  if((flags & MAP_SHARED) && f){
+    shm = &f->ip->shm;
+  } else if(flags & MAP_SHARED){
+    if((shm = kmem_cache_alloc(shmcache)) == 0)
+      return -1;
+    shminit(shm);
+  }
+
+  acquire(&p->lock);
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(v->len == 0){
+      nv = v;
+      break;
+    }
+  }
+  if(nv == 0 || (addr = vmaplace(p, len)) == 0){
+    release(&p->lock);
+    if(shm && f == 0)
+      kmem_cache_free(shmcache, shm);
+    return -1;
+  }
+  nv->addr = addr;
+  nv->len = len;
+  nv->prot = prot;
+  nv->flags = flags;
+  nv->f = f;
+  nv->off = off;
+  nv->shm = shm;
+  vmadup(nv);
+  release(&p->lock);
+  return addr;
+}
+
+// Called by vmfault() for a fault at page va
+// above the heap of the current process.
+// Returns 0 if the access can be retried, -1 if
+// va is not mapped, or not mapped for access.
+int
+vmafault(uint64 va, int access)
+{
+  struct proc *p = myproc();
+  struct vma *v, cv;
+  struct inode *ip;
+  char *mem;
+  uint off;
+  int r;
+
+  // reading the file sleeps, so a kernel copy that holds
+  // a spinlock must have faulted the page in beforehand
+  // (uvmprefault()).
+  if(holding_spinlocks())
+    return -1;
+
+  acquire(&p->lock);
+  if((v = vmalookup(p, va)) == 0 || (vmaperm(v->prot) & access) == 0){
+    release(&p->lock);
+    return -1;
+  }
+  cv = *v;
+  vmadup(&cv);
+  release(&p->lock);
+
+  ip = cv.f ? cv.f->ip : 0;
+  off = cv.off + (va - cv.addr);
+  r = -1;
+  if(ip)
+    ilock(ip);  // for a shared page, also keeps writei() out until it's added
+  if(cv.shm == 0 || (mem = shmget(cv.shm, off)) == 0){
+    if((mem = kalloc_swap()) != 0 && ip)
+      readi(ip, 0, (uint64)mem, off, PGSIZE);
+    if(mem && cv.shm)
+      mem = shmadd(cv.shm, off, mem);
+  }
+  if(ip)
+    iunlock(ip);
+  if(mem == 0)
+    goto out;
+
+  // munmap() may have run while we were reading.
+  acquire(&p->lock);
+  if((v = vmalookup(p, va)) == 0 || v->f != cv.f || v->shm != cv.shm){
+    release(&p->lock);
+    kfree(mem);
+    goto out;
+  }
+  r = uvminstall(p->pagetable, va, (uint64)mem, vmaperm(v->prot));
+  release(&p->lock);
+
+ out:
+  vmaclose(&cv);
+  return r;
+}
+
+// Write the page at pa back to ip at off, without extending
+// the file. Returns 0, or -1 if the file can't be written,
+// e.g. while a process runs it as its program.
+static int
+vmawriteback(struct inode *ip, uint64 pa, uint off)
+{
+  uint i;
+  int n, nop, r = 0;
+
+  for(i = 0; i < PGSIZE && r == 0; i += n){
+    n = PGSIZE - i;
+    nop = filewriteop(&n);
+    begin_opn(nop);
+    ilock(ip);
+    // don't extend the file.
+    if(off + i >= ip->size)
+      n = 0;
+    else if(off + i + n > ip->size)
+      n = ip->size - off - i;
+    if(n > 0 && writei(ip, 0, pa + i, off + i, n) != n)
+      r = -1;
+    iunlock(ip);
+    end_opn(nop);
+    if(n == 0)
+      break;
+  }
+  return r;
+}
+
+// Write back the pages of [va, va+len) that the process
+// dirtied, if the region is a MAP_SHARED file mapping,
+// then unmap them. A page that can't be written back
+// stays in the file's shm, marked dirty, so that no
+// other mapping loses the stores; each later vmaunmap()
+// of the file tries again.
+// v is a copy of the region, no longer in p->vmas.
+// Returns 0, or -1 if some page wasn't written back.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f ? v->f->ip : 0;
+  uint64 a, pa;
+  uint off, from;
+  pte_t *pte;
+  int r = 0;
+
+  if(ip == 0 || (v->flags & MAP_SHARED) == 0){
+    uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+    return 0;
+  }
+
+  for(from = 0; (pa = (uint64)shmtakedirty(v->shm, from, &off)) != 0; from = off + PGSIZE){
+    if(vmawriteback(ip, pa, off) < 0)
+      shmsetdirty(v->shm, off);
+    kfree((void*)pa);
+  }
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+    off = v->off + (a - v->addr);
+    if(vmawriteback(ip, PTE2PA(*pte), off) < 0){
+      shmsetdirty(v->shm, off);
+      r = -1;
+    }
+  }
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+  shmdrop(v->shm, 0);  // written back above, or by whoever else maps them
+  return r;
+}
+
+// Unmap [addr, addr+len), which must lie within one region,
+// at its start, its end, or in the middle if there is a
+// free slot for the second half. Returns 0, or -1 if the
+// range isn't unmapped, or some of it wasn't written back.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv, cv;
+  int r;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+
+  acquire(&p->lock);
+  if((v = vmalookup(p, addr)) == 0 || addr + len > v->addr + v->len){
+    release(&p->lock);
+    return -1;
+  }
+  cv = *v;
+  if(addr == v->addr && len == v->len){
+    v->len = 0;
+    v->addr = 0;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+    vmadup(v);
+  } else if(addr + len == v->addr + v->len){
+    v->len -= len;
+    vmadup(v);
+  } else {
+    for(nv = p->vmas; nv < &p->vmas[NVMA]; nv++)
+      if(nv->len == 0)
+        break;
+    if(nv == &p->vmas[NVMA]){
+      release(&p->lock);
+      return -1;
+    }
+    *nv = *v;
+    nv->addr = addr + len;
+    nv->off += nv->addr - v->addr;
+    nv->len = v->addr + v->len - nv->addr;
+    v->len = addr - v->addr;
+    vmadup(v);
+    vmadup(v);
+  }
+  release(&p->lock);
+
+  r = vmaunmap(p, &cv, addr, len);
+  vmaclose(&cv);
+  return r;
+}
+
+// Unmap every region, as exec() and exit() do.
+void
+vmaunmapall(struct proc *p)
+{
+  struct vma *v, cv;
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    acquire(&p->lock);
+    cv = *v;
+    v->len = 0;
+    v->addr = 0;
+    release(&p->lock);
+    if(cv.len){
+      vmaunmap(p, &cv, cv.addr, cv.len);
+      vmaclose(&cv);
+    }
+  }
+}
+
+// Give np copies of p's regions: MAP_SHARED pages are shared,
+// MAP_PRIVATE ones copy-on-write. Called by fork() with
+// np->lock held. Returns 0, or -1 after undoing the copy.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+
+  acquire(&p->lock);
+  for(v = p->vmas, nv = np->vmas; v < &p->vmas[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->len,
+                    v->flags & MAP_SHARED) < 0)
+      goto bad;
+    *nv = *v;
+    vmadup(nv);
+  }
+  release(&p->lock);
+  return 0;
+
+ bad:
+  release(&p->lock);
+  for(nv = np->vmas; nv < &np->vmas[NVMA]; nv++){
+    if(nv->len == 0)
+      continue;
+    uvmunmap(np->pagetable, nv->addr, nv->len / PGSIZE, 1);
+    vmaclose(nv);  // p still holds references, so this won't sleep.
+    nv->len = 0;
+    nv->addr = 0;
+  }
+  return -1;
+}
@@ -1,5 +1,5 @@
 #define NPROC        64  // maximum number of processes
-#define NCPU          8  // maximum number of CPUs
+#define NCPU          8  // maximum number of CPUs; ncpu says how many there are
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
@@ -7,9 +7,10 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      128  // default size of on-disk log, in blocks (mkfs -l)
+#define NBUF         (MAXOPBLOCKS*3)  // least size of disk block cache
+#define FSSIZE       20000  // size of file system in blocks
+#define SWAPSIZE     16384 // size of swap area, after the file system, in blocks
 #define MAXPATH      128   // maximum file path name
 
 #define NSIGS        32    // maximum number of signals
@@ -20,3 +21,5 @@
 #define SIGCONT      19
 
 #define MAX_STACK_SIZE  4000
+
+#define MAXORDER     9     // largest kalloc_pages() block is 2^9 pages (2 MB)
@@ -5,10 +5,16 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "spawn.h"
 
 #define MAX_BSEM 128
 
-struct binary_semaphore Bsemaphores[MAX_BSEM];
+// descriptor table; bsem_lock protects the slots.
+struct binary_semaphore *Bsemaphores[MAX_BSEM];
+struct spinlock bsem_lock;
+static struct kmem_cache *bsemcache;
+
+static struct kmem_cache *tfcache;  // trapframe backups
 
 struct cpu cpus[NCPU];
 
@@ -24,6 +30,7 @@ int nexttid = 1;
 struct spinlock tid_lock;
 
 extern void forkret(void);
+static void kprocret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -55,9 +62,8 @@ proc_mapstacks(pagetable_t kpgtbl) {
 }
 
 void init_bsem_locks(){
-    for (struct binary_semaphore *bsem = Bsemaphores; bsem < &Bsemaphores[MAX_BSEM]; bsem++) {
-        initlock(&bsem->lock, "binary_semaphore");
-    }
+    initlock(&bsem_lock, "bsem_table");
+    bsemcache = kmem_cache_create("binary_semaphore", sizeof(struct binary_semaphore));
 }
 
 // initialize the proc table at boot time.
@@ -71,6 +77,7 @@ procinit(void)
   initlock(&wait_lock, "wait_lock");
   initlock(&tid_lock, "nexttid");
   init_bsem_locks();
+  tfcache = kmem_cache_create("trapframe", sizeof(struct trapframe));
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       for(t = p->p_threads; t < &p->p_threads[NTHREAD]; t++) {
@@ -149,7 +156,7 @@ static void
 freethread(struct thread* t)
 {
   if(t->user_trap_backup)
-    kfree((void*)t->user_trap_backup);
+    kmem_cache_free(tfcache, t->user_trap_backup);
   t->user_trap_backup = 0;
   if(t->kstack)
     kfree((void*)t->kstack);
@@ -190,8 +197,8 @@ allocthread(struct proc* p)
   t->parent = p;
   t->killed = 0;
 
-  // Allocate a trapframe backup page.
-  if((t->user_trap_backup = (struct trapframe *)kalloc()) == 0){
+  // Allocate a trapframe backup.
+  if((t->user_trap_backup = kmem_cache_alloc(tfcache)) == 0){
     freethread(t);  
     release(&t->lock);
     return 0;
@@ -310,6 +317,8 @@ freeproc(struct proc *p)
 
   p->in_signal_handler = 0;
   p->prev_sig_mask = 0;
+  p->kfunc = 0;
+  memset(p->segs, 0, sizeof(p->segs));
 
   struct thread *t;
   for(t = p->p_threads; t < &p->p_threads[NTHREAD]; t++) {
@@ -329,6 +338,11 @@ proc_pagetable(struct proc *p)
   if(pagetable == 0)
     return 0;
 
+  // each proc slot has its own ASID. no cpu may use TLB
+  // entries left from the slot's earlier page tables.
+  p->asid = useasids ? (p - proc) + 1 : 0;
+  __sync_fetch_and_add(&p->tlbgen, 1);
+
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
@@ -398,20 +412,46 @@ userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel process that runs fn() on its own
+// kernel stack and never returns to user space.
+// Used for background housekeeping, e.g. kswapd.
+void
+kproc_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+  struct thread *t;
+
+  if((p = allocproc()) == 0)
+    panic("kproc_create");
+
+  p->kfunc = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  t = &p->p_threads[0];
+  acquire(&t->lock);
+  t->context.ra = (uint64)kprocret;
+  t->state = T_RUNNABLE;
+  release(&t->lock);
+
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
   acquire(&p->lock);
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // pages are allocated by vmfault() on first touch.
+    if(sz + n > vmabase(p)) {
       release(&p->lock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -443,6 +483,11 @@ fork(void)
     return -1;
   }
   np->sz = p->sz;
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   nt = &np->p_threads[0];
 
@@ -457,6 +502,11 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->execip){
+    np->execip = idup(p->execip);
+    iexec(np->execip);
+  }
+  memmove(np->segs, p->segs, sizeof(p->segs));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -486,6 +536,116 @@ fork(void)
   return pid;
 }
 
+// Create a new process running the program at path, without
+// copying the parent: the child's address space is built
+// straight from the ELF file, as exec() would build it.
+// The child starts with the parent's open files, edited by
+// the nact actions in act, its cwd, and its signal state
+// as exec() leaves it. Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct spawn_action *act, int nact)
+{
+  int i, argc, pid;
+  char *s, *last;
+  struct image img;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct thread *nt;
+  struct file *f;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  // loading the program sleeps; np is invisible to the
+  // scheduler and to wait() until it has a runnable
+  // thread and a parent.
+  release(&np->lock);
+
+  if((argc = execload(np, path, argv, &img)) < 0)
+    goto bad;
+  proc_freepagetable(np->pagetable, 0);
+  acquire(&np->lock);  // kswapd looks at them
+  np->pagetable = img.pagetable;
+  np->sz = img.sz;
+  release(&np->lock);
+  np->execip = img.ip;
+  memmove(np->segs, img.segs, sizeof(np->segs));
+
+  nt = &np->p_threads[0];
+  memset(nt->trapframe, 0, sizeof(*nt->trapframe));
+  nt->trapframe->epc = img.entry;
+  nt->trapframe->sp = img.sp;
+  nt->trapframe->a0 = argc;
+  nt->trapframe->a1 = img.sp;
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  for(i = 0; i < nact; i++){
+    if(act[i].fd < 0 || act[i].fd >= NOFILE || (f = np->ofile[act[i].fd]) == 0)
+      goto bad;
+    if(act[i].op == SPAWN_CLOSE){
+      np->ofile[act[i].fd] = 0;
+      fileclose(f);
+    } else if(act[i].op == SPAWN_DUP2){
+      if(act[i].newfd < 0 || act[i].newfd >= NOFILE)
+        goto bad;
+      if(act[i].newfd == act[i].fd)
+        continue;
+      if(np->ofile[act[i].newfd])
+        fileclose(np->ofile[act[i].newfd]);
+      np->ofile[act[i].newfd] = filedup(f);
+    } else {
+      goto bad;
+    }
+  }
+  np->cwd = idup(p->cwd);
+
+  for(last=s=path; *s; s++)
+    if(*s == '/')
+      last = s+1;
+  safestrcpy(np->name, last, sizeof(np->name));
+
+  // signal state as after fork() and exec().
+  acquire(&np->lock);
+  np->sig_mask = p->sig_mask;
+  np->pending_signals = 0;
+  for(int sig = 0; sig < NSIGS; sig++) {
+    if(p->sig_handlers[sig] == (void*)SIG_IGN)
+      np->sig_handlers[sig] = (void*)SIG_IGN;
+    np->sig_handlers_masks[sig] = 0;
+  }
+  pid = np->pid;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&nt->lock);
+  nt->state = T_RUNNABLE;
+  release(&nt->lock);
+
+  return pid;
+
+ bad:
+  for(i = 0; i < NOFILE; i++){
+    if(np->ofile[i]){
+      fileclose(np->ofile[i]);
+      np->ofile[i] = 0;
+    }
+  }
+  if(np->execip){
+    begin_op();
+    iexecput(np->execip);
+    end_op();
+    np->execip = 0;
+  }
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -513,6 +673,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop memory mappings.
+  vmaunmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -524,8 +687,11 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->execip)
+    iexecput(p->execip);
   end_op();
   p->cwd = 0;
+  p->execip = 0;
 
   acquire(&wait_lock);
 
@@ -586,6 +752,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout below holds spinlocks.
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int), PTE_W);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -639,6 +809,7 @@ scheduler(void)
   struct proc *p;
   struct thread *t;
   struct cpu *c = mycpu();
+  int ran;
 
   // printf("in scheudler cpuid: %d\n", cpuid());
   
@@ -647,6 +818,7 @@ scheduler(void)
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
+    ran = 0;
 
     for(p = proc; p < &proc[NPROC]; p++) {
       if(p->state == USED) {
@@ -658,6 +830,7 @@ scheduler(void)
           // printf("after acquire tlock pid: %d, cpuid: %d\n", p->pid, cpuid());
           if(t->state == T_RUNNABLE){
             t->state = T_RUNNING;
+            ran = 1;
             c->thread = t;
             c->proc = p;
             // printf("before swtch\n");
@@ -674,6 +847,10 @@ scheduler(void)
         }
       }
     }   
+
+    // nothing wanted the CPU; fill the pool of zeroed pages.
+    if(!ran)
+      kzeroidle();
   }
 }
 
@@ -737,6 +914,18 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel process's very first scheduling by scheduler()
+// will swtch to kprocret.
+static void
+kprocret(void)
+{
+  // Still holding t->lock from scheduler.
+  release(&mythread()->lock);
+
+  myproc()->kfunc();
+  panic("kprocret");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -898,26 +1087,26 @@ sigaction(int signum, uint64 act, uint64 oldact)
   if(signum < 0 || signum > NSIGS || signum == SIGKILL || signum == SIGSTOP)
     return -1;
   
-  acquire(&p->lock);
-
-  if (oldact) {
-    copyout(p->pagetable, oldact, (char*)&p->sig_handlers[signum], sizeof(p->sig_handlers[signum]));
-    copyout(p->pagetable, oldact + sizeof(p->sig_handlers[signum]), (char*)&p->sig_handlers_masks[signum], sizeof(uint));
-  }
-
-  struct sigaction temp;
-  if(act && copyin(p->pagetable, (char*)&temp, act, sizeof(struct sigaction)) >= 0) {
-    // check that the new mask is not blocking sigkill or sigstop
-    if((((1 << SIGKILL) & temp.sigmask) != 0) || (((1 << SIGSTOP) & temp.sigmask) != 0)) {
-      release(&p->lock);
-      return -1;
-    }
+  // copy in and out without p->lock, since either may page fault.
+  struct sigaction temp, old;
+  int newact = act && copyin(p->pagetable, (char*)&temp, act, sizeof(struct sigaction)) >= 0;
+  // check that the new mask is not blocking sigkill or sigstop
+  if(newact && ((((1 << SIGKILL) & temp.sigmask) != 0) || (((1 << SIGSTOP) & temp.sigmask) != 0)))
+    return -1;
 
+  acquire(&p->lock);
+  old.sa_handler = p->sig_handlers[signum];
+  old.sigmask = p->sig_handlers_masks[signum];
+  if(newact) {
     p->sig_handlers[signum] = temp.sa_handler;
     p->sig_handlers_masks[signum] = temp.sigmask;
   }
-
   release(&p->lock);
+
+  if (oldact) {
+    copyout(p->pagetable, oldact, (char*)&old.sa_handler, sizeof(old.sa_handler));
+    copyout(p->pagetable, oldact + sizeof(old.sa_handler), (char*)&old.sigmask, sizeof(uint));
+  }
   return 0;
 }
 
@@ -1042,8 +1231,11 @@ handle_signals()
         uint sig_ret_size = sig_ret_end - sig_ret_start;
         // allocate space for sigret function
         t->trapframe->sp -= sig_ret_size;
-        // move sigret to stack
+        // move sigret to stack; the copy may page fault, so drop p->lock.
+        // in_signal_handler keeps other threads out meanwhile.
+        release(&p->lock);
         copyout(p->pagetable, (uint64)t->trapframe->sp, (char*)&sig_ret_start, sig_ret_size);
+        acquire(&p->lock);
         // move signum to a0
         t->trapframe->a0 = i;
         // move sigret to ra
@@ -1141,6 +1333,10 @@ kthread_join(int thread_id, int *status)
   struct thread *t_tojoin  = 0;
   struct proc *p = myproc();
 
+  // the copyout below holds t_tojoin->lock.
+  if(status != 0)
+    uvmprefault((uint64)status, sizeof(int), PTE_W);
+
   // find the target thread
   for (struct thread *t = p->p_threads; t < &p->p_threads[NTHREAD]; t++) {
     acquire(&t->lock);
@@ -1173,51 +1369,100 @@ kthread_join(int thread_id, int *status)
 }
 
 
+// Look up a semaphore descriptor.
+// Returns the semaphore with its lock held, or 0.
+static struct binary_semaphore*
+bsem_get(int descriptor) {
+    struct binary_semaphore *bsem = 0;
+
+    acquire(&bsem_lock);
+    if (descriptor >= 0 && descriptor < MAX_BSEM) {
+        bsem = Bsemaphores[descriptor];
+        if (bsem)
+            acquire(&bsem->lock);
+    }
+    release(&bsem_lock);
+    return bsem;
+}
+
 int bsem_alloc() {
 
     int descriptor;
-    int found = 0;
-    for (descriptor = 0; !found && descriptor < MAX_BSEM; descriptor++) {
-      acquire(&Bsemaphores[descriptor].lock);
-      if(!Bsemaphores[descriptor].occupied){
-          found = 1;
-          break;
-      }
-      release(&Bsemaphores[descriptor].lock);
-    }
-    if (!found) {
+    struct binary_semaphore *bsem;
+
+    if ((bsem = kmem_cache_alloc(bsemcache)) == 0) {
         return -1;
     }
-    Bsemaphores[descriptor].occupied = 1;
-    Bsemaphores[descriptor].value = 1; // the allocated semaphore in unlocked state
-    release(&Bsemaphores[descriptor].lock);
-    return descriptor;
+    initlock(&bsem->lock, "binary_semaphore");
+    bsem->occupied = 1;
+    bsem->value = 1; // the allocated semaphore in unlocked state
+    bsem->waiters = 0;
+
+    acquire(&bsem_lock);
+    for (descriptor = 0; descriptor < MAX_BSEM; descriptor++) {
+      if(!Bsemaphores[descriptor]){
+          Bsemaphores[descriptor] = bsem;
+          release(&bsem_lock);
+          return descriptor;
+      }
+    }
+    release(&bsem_lock);
+    kmem_cache_free(bsemcache, bsem);
+    return -1;
 }
 
+// The last thread to let go of a freed semaphore releases its memory.
 void bsem_free(int descriptor) {
-    acquire(&Bsemaphores[descriptor].lock);
-    Bsemaphores[descriptor].occupied = 0;
-    // Bsemaphores[descriptor].value = 1;
-    release(&Bsemaphores[descriptor].lock);
+    struct binary_semaphore *bsem = 0;
+
+    acquire(&bsem_lock);
+    if (descriptor >= 0 && descriptor < MAX_BSEM) {
+        bsem = Bsemaphores[descriptor];
+        Bsemaphores[descriptor] = 0;
+        if (bsem)
+            acquire(&bsem->lock);
+    }
+    release(&bsem_lock);
+    if (!bsem)
+        return;
+
+    bsem->occupied = 0;
+    if (bsem->waiters) {
+        wakeup(bsem);
+        release(&bsem->lock);
+    } else {
+        release(&bsem->lock);
+        kmem_cache_free(bsemcache, bsem);
+    }
 }
 
 void bsem_down(int descriptor) {
-    acquire(&Bsemaphores[descriptor].lock);
-    if (Bsemaphores[descriptor].occupied) {
-        while(Bsemaphores[descriptor].value == 0){
-            sleep(&Bsemaphores[descriptor], &Bsemaphores[descriptor].lock);
-        }
-        Bsemaphores[descriptor].value = 0;
+    struct binary_semaphore *bsem;
+
+    if ((bsem = bsem_get(descriptor)) == 0)
+        return;
+    bsem->waiters++;
+    while(bsem->occupied && bsem->value == 0){
+        sleep(bsem, &bsem->lock);
     }
-    release(&Bsemaphores[descriptor].lock);
+    bsem->waiters--;
+    if (bsem->occupied) {
+        bsem->value = 0;
+    } else if (bsem->waiters == 0) {
+        release(&bsem->lock);
+        kmem_cache_free(bsemcache, bsem);
+        return;
+    }
+    release(&bsem->lock);
 }
 
 void bsem_up(int descriptor) {
+    struct binary_semaphore *bsem;
+
     printf("in bsem up\n");
-    acquire(&Bsemaphores[descriptor].lock);
-    if (Bsemaphores[descriptor].occupied) {
-        Bsemaphores[descriptor].value = 1;
-        wakeup(&Bsemaphores[descriptor]);
-    }
-    release(&Bsemaphores[descriptor].lock);
+    if ((bsem = bsem_get(descriptor)) == 0)
+        return;
+    bsem->value = 1;
+    wakeup(bsem);
+    release(&bsem->lock);
 }
@@ -25,6 +25,7 @@ struct cpu {
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
   struct thread *thread;        // The thread running on this cpu, or null.
+  uint asidgen[NPROC+1];      // p->tlbgen when this cpu last flushed each ASID.
 };
 
 extern struct cpu cpus[NCPU];
@@ -102,9 +103,45 @@ struct thread
   struct spinlock lock;
   struct proc *parent;         // Parent process of thread
   struct context context;      // swtch() here to run process
+  int kpreempted;              // yielded in the middle of kernel code
+  uint64 pinva;                // pages uvmprefault() faulted in for this
+  uint64 pinlen;               // system call, kept from being swapped out
 };
 
 
+// A region of the address space made by mmap().
+#define NVMA 16
+struct vma {
+  uint64 addr;                 // First address, page-aligned; 0 if unused
+  uint64 len;                  // Length in bytes, a multiple of PGSIZE
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE, maybe MAP_ANONYMOUS
+  struct file *f;              // Mapped file, or 0 if anonymous
+  uint off;                    // File offset of addr
+  struct shm *shm;             // MAP_SHARED: the pages it shares
+};
+
+// A loadable segment of the running program, read in
+// from the program file a page at a time as it is touched.
+#define NSEG 8
+struct seg {
+  uint64 va;                   // First address, page-aligned
+  uint64 memsz;                // Length in memory; 0 if unused
+  uint64 off;                  // File offset of va
+  uint64 filesz;               // Bytes to read from the file; the rest is zero
+  int perm;                    // PTE_R, PTE_W, PTE_X
+};
+
+// A new program image built by execload(), not yet installed.
+struct image {
+  pagetable_t pagetable;
+  uint64 sz;
+  uint64 sp;                   // initial stack pointer, also argv
+  uint64 entry;
+  struct inode *ip;            // program file
+  struct seg segs[NSEG];
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -140,6 +177,12 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   struct thread p_threads[NTHREAD];   // Threads running in this process
+  void (*kfunc)(void);         // Body of a kernel process, or 0
+  struct vma vmas[NVMA];       // mmap() regions; p->lock must be held
+  int asid;                    // TLB tag of pagetable; 0 if ASIDs aren't used
+  uint tlbgen;                 // Bumped when mappings are removed or restricted
+  struct inode *execip;        // Program file, for demand paging
+  struct seg segs[NSEG];       // Its segments, loaded on demand
 };
 
 struct sigaction {
@@ -150,6 +193,7 @@ struct sigaction {
 struct binary_semaphore {
     int occupied;
     int value;
+    int waiters;     // threads in bsem_down()
     struct spinlock lock;
 };
 
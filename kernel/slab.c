@@ -0,0 +1,256 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// Each kmem_cache hands out objects of a single size,
+// carved from whole pages (slabs) obtained with kalloc().
+// A slab's header sits at the start of its page, so the
+// slab an object belongs to is found by rounding down.
+//
+// Each CPU keeps a small stack of free objects (a magazine)
+// per cache, so most allocations and frees touch no shared
+// lock; the cache lock is only taken to refill or spill
+// half a magazine at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE  16  // maximum number of caches
+#define MAGSIZE 16  // objects per per-CPU magazine
+
+struct obj {
+  struct obj *next;
+};
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // on the cache's partial list
+  struct slab *prev;
+  struct obj *free;   // free objects in this slab
+  int inuse;          // objects handed out, including to magazines
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, rounded up
+  uint perslab;         // objects per slab
+  struct slab partial;  // slabs with free objects; full ones are on no list.
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+// first object in a slab.
+#define SLABHDR     ((sizeof(struct slab) + 7) & ~7)
+#define SLABOBJS(s) ((char*)(s) + SLABHDR)
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache of size-byte objects.
+// name must be a string constant; it also names the lock.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct obj))
+    size = sizeof(struct obj);
+  if(SLABHDR + size > PGSIZE)
+    panic("kmem_cache_create: too big");
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NCACHE)
+    panic("kmem_cache_create: too many");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  for(int i = 0; i < ncpu; i++)
+    c->mag[i].n = 0;
+  return c;
+}
+
+static void
+slab_unlink(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+}
+
+// Take an object from a partial slab, or return 0
+// if there is none. Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s = c->partial.next;
+  struct obj *o;
+
+  if(s == &c->partial)
+    return 0;
+  o = s->free;
+  s->free = o->next;
+  s->inuse++;
+  if(s->free == 0)
+    slab_unlink(s);
+  return o;
+}
+
+// Return an object to its slab. Frees the slab's page
+// if it ends up empty and is not the cache's only
+// partial slab. Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *p)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)p);
+  struct obj *o = p;
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->free == 0)
+    slab_link(c, s);
+  o->next = s->free;
+  s->free = o;
+  s->inuse--;
+  if(s->inuse == 0 && (s->next != &c->partial || s->prev != &c->partial)){
+    slab_unlink(s);
+    kfree((void*)s);
+  }
+}
+
+// Add a fresh slab to c. Takes and releases c->lock.
+// Returns 0 if out of memory.
+static int
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  p = SLABOBJS(s) + (c->perslab - 1) * c->size;
+  for(; p >= SLABOBJS(s); p -= c->size){
+    ((struct obj*)p)->next = s->free;
+    s->free = (struct obj*)p;
+  }
+  acquire(&c->lock);
+  slab_link(c, s);
+  release(&c->lock);
+  return 1;
+}
+
+// Allocate an object from c.
+// Returns 0 if memory cannot be allocated.
+// The contents of the object are undefined.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *o, *x;
+
+  for(;;){
+    push_off();
+    m = &c->mag[cpuid()];
+    if(m->n > 0){
+      o = m->obj[--m->n];
+      pop_off();
+      return o;
+    }
+    acquire(&c->lock);
+    o = slab_get(c);
+    while(o && m->n < MAGSIZE/2 && (x = slab_get(c)) != 0)
+      m->obj[m->n++] = x;
+    release(&c->lock);
+    pop_off();
+    if(o)
+      return o;
+    // kalloc() may reclaim from caches, so call it with no locks held.
+    if(!slab_grow(c))
+      return 0;
+  }
+}
+
+// Free an object that was allocated from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Called by kalloc() when memory runs out: empty this CPU's
+// magazines and free every empty slab.
+// Returns the number of pages freed.
+int
+slab_reclaim(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  struct slab *s, *nx;
+  int n, freed = 0;
+
+  acquire(&slabs.lock);
+  n = slabs.n;
+  release(&slabs.lock);
+
+  for(c = slabs.cache; c < &slabs.cache[n]; c++){
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&c->lock);
+    while(m->n > 0)
+      slab_put(c, m->obj[--m->n]);
+    for(s = c->partial.next; s != &c->partial; s = nx){
+      nx = s->next;
+      if(s->inuse == 0){
+        slab_unlink(s);
+        kfree((void*)s);
+        freed++;
+      }
+    }
+    release(&c->lock);
+    pop_off();
+  }
+  return freed;
+}
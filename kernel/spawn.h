@@ -0,0 +1,11 @@
+// File actions for spawn(), applied in order to the
+// child's copy of the parent's open files.
+#define SPAWN_CLOSE 1  // close fd
+#define SPAWN_DUP2  2  // make newfd a copy of fd
+#define NSPAWNACT   8  // maximum actions per spawn()
+
+struct spawn_action {
+  int op;
+  int fd;
+  int newfd;
+};
@@ -81,6 +81,23 @@ holding(struct spinlock *lk)
   return r;
 }
 
+// Whether this cpu holds any spinlock, and so must not
+// sleep, e.g. to wait for the disk. acquire() leaves a
+// push_off() in place until the matching release(); every
+// other push_off() is popped again before its caller can
+// call anything that might sleep or fault. So outside
+// those short sections, noff is the number of spinlocks held.
+int
+holding_spinlocks(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff - 1;
+  pop_off();
+  return n > 0;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
@@ -16,9 +16,13 @@ uint64 timer_scratch[NCPU][5];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
-// entry.S jumps here in machine mode on stack0.
+// set once hart 0 has read the device tree.
+volatile static int fdtdone = 0;
+
+// entry.S jumps here in machine mode on stack0,
+// with the device tree blob the firmware passed in a1.
 void
-start()
+start(uint64 fdt)
 {
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
@@ -38,11 +42,32 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // allow supervisor mode to read the time counter,
+  // for boot timing in main().
+  w_mcounteren(r_mcounteren() | 2);
+
+  // learn how much RAM and how many harts there are.
+  // a hart the device tree doesn't list stays here,
+  // with no timer to wake it.
+  int id = r_mhartid();
+  if(id == 0){
+    fdtinit(fdt);
+    __sync_synchronize();
+    fdtdone = 1;
+  } else {
+    while(fdtdone == 0)
+      ;
+    __sync_synchronize();
+    if(id >= ncpu){
+      for(;;)
+        asm volatile("wfi");
+    }
+  }
+
   // ask for clock interrupts.
   timerinit();
 
   // keep each CPU's hartid in its tp register, for cpuid().
-  int id = r_mhartid();
   w_tp(id);
 
   // switch to supervisor mode and jump to main().
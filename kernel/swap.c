@@ -0,0 +1,397 @@
+//
+// Swapping user pages to a dedicated area of the disk,
+// after the file system (mkfs puts it there, and the
+// super block says where it is).
+//
+// The swap area is divided into page-sized slots. When
+// free memory runs low, kswapd, or an allocation that
+// found no free page, sweeps a clock hand over the user
+// pages of every process. A page whose PTE_A bit is set
+// has been used since the hand last passed; the hand
+// clears the bit and gives it a second chance. Otherwise
+// the page is written to a free slot and freed, and its
+// PTE is left invalid with PTE_S set and the slot number
+// in place of the physical page number. vmfault() calls
+// swapin() to read the page back on the next touch.
+//
+// Only private heap, stack and data pages are swapped:
+// not pages shared with another page table or the program
+// text cache, or mmap() regions. A cold megapage is split
+// up first.
+//
+// A page is evicted only while none of its process's
+// threads can touch it: none is running, or preempted
+// in the middle of kernel code, which may be holding the
+// page's physical address. The threads' locks are held
+// while the PTE changes, so none can start meanwhile.
+// Until the page has been written out, the slot keeps
+// it (the swap cache), and a fault just maps it again.
+//
+// swap.lock protects the slot table. A slot is in use
+// while PTEs refer to it (fork() shares them) or while
+// it holds a page.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "memstat.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)      // disk blocks per slot
+#define NSLOT      (SWAPSIZE / SLOTBLOCKS)
+#define SWAPLOW    256   // kswapd evicts while fewer pages than this are free
+#define SWAPBATCH  32    // pages to evict at a time
+#define SWAPSCAN   4096  // most pages to look at for one batch
+
+extern struct proc proc[NPROC];
+
+struct slot {
+  ushort ref;   // swapped-out PTEs that refer to it
+  char *pa;     // the page, while it is being written out
+};
+
+struct {
+  struct spinlock lock;
+  struct slot slots[NSLOT];
+  int nslots;             // 0 if there is no swap area
+  int dev;
+  uint start;             // first block of the swap area
+
+  struct sleeplock io;    // protects buf[]
+  struct buf buf[SLOTBLOCKS];
+
+  struct sleeplock scan;  // one sweep at a time; protects the hand
+  int hand;               // index in proc[] of the process
+  uint64 handva;          // and the page the hand points at
+} swap;
+
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+  initsleeplock(&swap.scan, "swapscan");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  __sync_synchronize();
+  swap.nslots = sb->nswap / SLOTBLOCKS;
+  if(swap.nslots > NSLOT)
+    swap.nslots = NSLOT;
+}
+
+// Read or write the page pa from or to slot, straight
+// to or from pa, with one disk request per block, all
+// started together.
+static void
+swaprw(int slot, char *pa, int write)
+{
+  struct buf *bs[SLOTBLOCKS];
+
+  acquiresleep(&swap.io);
+  for(int i = 0; i < SLOTBLOCKS; i++){
+    bs[i] = &swap.buf[i];
+    bs[i]->dev = swap.dev;
+    bs[i]->blockno = swap.start + slot*SLOTBLOCKS + i;
+    bs[i]->data = (uchar*)pa + i*BSIZE;
+  }
+  virtio_disk_start(bs, SLOTBLOCKS, write);
+  for(int i = 0; i < SLOTBLOCKS; i++)
+    virtio_disk_wait(bs[i]);
+  releasesleep(&swap.io);
+}
+
+// Find a free slot for the page pa, which the slot
+// holds until swapdone(). Returns the slot, or -1.
+static int
+slotalloc(char *pa)
+{
+  struct slot *s;
+
+  acquire(&swap.lock);
+  for(s = swap.slots; s < &swap.slots[swap.nslots]; s++){
+    if(s->ref == 0 && s->pa == 0){
+      s->ref = 1;
+      s->pa = pa;
+      release(&swap.lock);
+      return s - swap.slots;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Drop a reference to slot.
+static void
+slotput(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.slots[slot].ref < 1)
+    panic("slotput");
+  swap.slots[slot].ref--;
+  release(&swap.lock);
+}
+
+// The page in slot has been written out; free it.
+static void
+swapdone(int slot)
+{
+  char *pa;
+
+  acquire(&swap.lock);
+  pa = swap.slots[slot].pa;
+  swap.slots[slot].pa = 0;
+  release(&swap.lock);
+  kfree(pa);
+}
+
+// Another PTE now refers to the slot in swapped-out pte,
+// as when fork() copies it. Caller holds vmlock.
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.lock);
+  swap.slots[PTE2SLOT(pte)].ref++;
+  release(&swap.lock);
+}
+
+// A swapped-out PTE is going away.
+void
+swapfree(pte_t pte)
+{
+  slotput(PTE2SLOT(pte));
+}
+
+// Lock every thread of p, unless one might be using
+// its pages: running, or preempted in the kernel.
+// Returns 1 if locked. Caller holds p->lock.
+static int
+swaplock(struct proc *p)
+{
+  struct thread *t, *u;
+
+  for(t = p->p_threads; t < &p->p_threads[NTHREAD]; t++){
+    acquire(&t->lock);
+    if(t->state == T_RUNNING || (t->state == T_RUNNABLE && t->kpreempted)){
+      for(u = p->p_threads; u <= t; u++)
+        release(&u->lock);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void
+swapunlock(struct proc *p)
+{
+  struct thread *t;
+
+  for(t = p->p_threads; t < &p->p_threads[NTHREAD]; t++)
+    release(&t->lock);
+}
+
+// Is va in pages that a thread of p faulted in with
+// uvmprefault(), to copy to or from under a spinlock?
+// Caller holds the threads' locks.
+static int
+swappinned(struct proc *p, uint64 va)
+{
+  struct thread *t;
+
+  for(t = p->p_threads; t < &p->p_threads[NTHREAD]; t++)
+    if(t->pinlen && va + PGSIZE > t->pinva && va < t->pinva + t->pinlen)
+      return 1;
+  return 0;
+}
+
+// Look at the page under the clock hand, evict it if
+// it is cold, and move the hand on.
+// Returns 1 if the page was evicted.
+// Caller holds swap.scan.
+static int
+swapone(void)
+{
+  struct proc *p = &proc[swap.hand];
+  uint64 va = swap.handva, pa;
+  pte_t *pte;
+  int level, slot = -1;
+
+  swap.handva += PGSIZE;
+  acquire(&p->lock);
+  if(p->state != USED || p->kfunc || va >= p->sz){
+    release(&p->lock);
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+    return 0;
+  }
+  if(!swaplock(p)){
+    // come back later.
+    release(&p->lock);
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+    return 0;
+  }
+
+  acquire(&vmlock);
+  pte = walklevel(p->pagetable, va, 0, &level);
+  if(pte && level == 1 && (*pte & PTE_A)){
+    // a megapage used since the hand last came by.
+    *pte &= ~PTE_A;
+    pte = 0;
+  } else if(pte && level == 1 && uvmsplit(pte) == 0){
+    // a cold megapage: break it up to swap out its pages.
+    pte = walklevel(p->pagetable, va, 0, &level);
+  }
+  if(pte == 0 || level != 0){
+    // nothing mapped here, or a megapage: skip the rest of it.
+    swap.handva = MEGAPGROUNDDOWN(va) + MEGAPGSIZE;
+  } else if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U) || swappinned(p, va)){
+    // not present, or the stack guard page.
+  } else if(*pte & PTE_A){
+    // used since the hand last came by: second chance.
+    *pte &= ~PTE_A;
+  } else {
+    pa = PTE2PA(*pte);
+    if(krefcnt((void*)pa) == 1 && (slot = slotalloc((char*)pa)) >= 0){
+      *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D)) | PTE_S;
+      __sync_fetch_and_add(&p->tlbgen, 1);
+    }
+  }
+  release(&vmlock);
+  swapunlock(p);
+  release(&p->lock);
+
+  if(slot < 0)
+    return 0;
+  swaprw(slot, (char*)pa, 1);
+  swapdone(slot);
+  return 1;
+}
+
+// Evict up to n cold pages. Returns how many were evicted.
+static int
+swapout(int n)
+{
+  int got = 0;
+
+  acquiresleep(&swap.scan);
+  for(int i = 0; i < SWAPSCAN && got < n; i++)
+    got += swapone();
+  releasesleep(&swap.scan);
+  return got;
+}
+
+// Called by vmfault() for a fault at va, whose PTE
+// in pagetable has PTE_S set: read the page back in.
+// Returns 0 if the access can be retried, -1 if out of
+// memory, or if the page has to be read from the disk
+// but the caller holds a spinlock.
+int
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte, old;
+  char *mem;
+  int slot;
+
+  acquire(&vmlock);
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_S) == 0){
+    // another thread got here first.
+    release(&vmlock);
+    return 0;
+  }
+  old = *pte;
+  slot = PTE2SLOT(old);
+  acquire(&swap.lock);
+  if((mem = swap.slots[slot].pa) != 0)
+    kref(mem);  // still being written out; use it.
+  else
+    swap.slots[slot].ref++;  // keep the slot while reading it.
+  release(&swap.lock);
+  if(mem){
+    *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_S) | PTE_V;
+    release(&vmlock);
+    slotput(slot);
+    return 0;
+  }
+  release(&vmlock);
+
+  if(holding_spinlocks() || (mem = kalloc_swap()) == 0){
+    slotput(slot);
+    return -1;
+  }
+  swaprw(slot, mem, 0);
+
+  acquire(&vmlock);
+  if(*pte == old){
+    *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_S) | PTE_V;
+    mem = 0;
+    slotput(slot);
+  }
+  release(&vmlock);
+  slotput(slot);
+  if(mem)
+    kfree(mem);
+  return 0;
+}
+
+// Allocate a zeroed page for user memory. If memory
+// has run out, swap out some cold pages to make room,
+// unless the caller holds a spinlock and so can't wait
+// for the disk. Returns 0 if memory cannot be allocated.
+void*
+kalloc_swap(void)
+{
+  char *mem;
+
+  while((mem = kalloc_zeroed()) == 0){
+    if(holding_spinlocks() || swap.nslots == 0 || swapout(SWAPBATCH) == 0)
+      return 0;
+  }
+  return mem;
+}
+
+// Body of the kswapd kernel process.
+// Keeps SWAPLOW pages free by shrinking the buffer
+// cache, or else swapping out cold pages, a batch
+// per scheduling round. Checks again every
+// tick while there is enough free memory, or nothing
+// more can be swapped out.
+void
+kswapd(void)
+{
+  struct memstat st;
+
+  for(;;){
+    kmemstat(&st);
+    if(st.nfree < SWAPLOW && breclaim(SWAPBATCH) > 0)
+      continue;  // shrink the buffer cache first
+    if(swap.nslots == 0 || st.nfree >= SWAPLOW || swapout(SWAPBATCH) == 0){
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+      continue;
+    }
+    yield();
+  }
+}
+
+// Fill in swap statistics for the memstat system call.
+void
+swapstat(struct memstat *st)
+{
+  st->nswap = swap.nslots;
+  st->nswapped = 0;
+  if(swap.nslots == 0)
+    return;
+  acquire(&swap.lock);
+  for(int i = 0; i < swap.nslots; i++)
+    if(swap.slots[i].ref || swap.slots[i].pa)
+      st->nswapped++;
+  release(&swap.lock);
+}
@@ -115,6 +115,12 @@ extern uint64 sys_bsem_alloc(void);
 extern uint64 sys_bsem_free(void);
 extern uint64 sys_bsem_down(void);
 extern uint64 sys_bsem_up(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_sync(void);
+extern uint64 sys_fsync(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -149,6 +155,12 @@ static uint64 (*syscalls[])(void) = {
 [SYS_bsem_free]     sys_bsem_free,
 [SYS_bsem_down]     sys_bsem_down,
 [SYS_bsem_up]       sys_bsem_up,
+[SYS_memstat]       sys_memstat,
+[SYS_mmap]          sys_mmap,
+[SYS_munmap]        sys_munmap,
+[SYS_spawn]         sys_spawn,
+[SYS_sync]          sys_sync,
+[SYS_fsync]         sys_fsync,
 };
 
 void
@@ -31,3 +31,9 @@
 #define SYS_bsem_free    30
 #define SYS_bsem_down    31
 #define SYS_bsem_up      32
+#define SYS_memstat      33
+#define SYS_mmap         34
+#define SYS_munmap       35
+#define SYS_spawn        36
+#define SYS_sync         37
+#define SYS_fsync        38
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -220,4 +221,20 @@ sys_bsem_up(void)
   bsem_up(descriptor);
 
   return 0;
-}
\ No newline at end of file
+}
+
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  swapstat(&st);
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
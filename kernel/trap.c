@@ -69,9 +69,16 @@ usertrap(void)
     intr_on();
 
     syscall();
+    t->pinlen = 0;
 
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 12 ? PTE_X :
+                    r_scause() == 13 ? PTE_R : PTE_W) == 0){
+    // lazily allocated or copy-on-write page.
+    // this cpu may hold the old entry for it.
+    sfence_vma_page(r_stval(), p->asid);
   } else {
 
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
@@ -132,7 +139,18 @@ usertrapret(void)
   w_sepc(t->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable, p->asid);
+
+  // drop this cpu's TLB entries for the address space if
+  // mappings were removed since it last did so. without
+  // ASIDs, trampoline.S flushes everything instead.
+  if(p->asid){
+    uint gen = p->tlbgen;
+    if(mycpu()->asidgen[p->asid] != gen){
+      sfence_vma_asid(p->asid);
+      mycpu()->asidgen[p->asid] = gen;
+    }
+  }
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -163,8 +181,13 @@ kerneltrap()
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && mythread() != 0 && mythread()->state == T_RUNNING)
+  // the thread may be holding physical addresses of its
+  // user pages, so they mustn't be swapped out meanwhile.
+  if(which_dev == 2 && mythread() != 0 && mythread()->state == T_RUNNING){
+    mythread()->kpreempted = 1;
     yield();
+    mythread()->kpreempted = 0;
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
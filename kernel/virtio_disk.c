@@ -20,6 +20,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// most blocks in one request; leaves room in the
+// ring for another request of the same size.
+#define MAXRUN (NUM/2 - 2)
+
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
@@ -59,7 +63,8 @@ static struct disk {
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status is indexed by first descriptor index of chain,
+  // b by the index of the descriptor for the buf's data.
   struct {
     struct buf *b;
     char status;
@@ -184,12 +189,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +204,44 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// tell the device about the requests added to the avail ring.
+static void
+notify(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  __sync_synchronize();
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  acquire(&disk.vdisk_lock);
+// Queue one request to read or write the n buffers in bs[],
+// which hold consecutive blocks, and return without waiting.
+// The device hasn't been told about it yet.
+// Caller must hold disk.vdisk_lock.
+static void
+queue(struct buf **bs, int n, int write, int *pending)
+{
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then the data, then a
+  // 1-byte status result. the data may take several descriptors,
+  // one per buffer here.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[MAXRUN+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n+2) == 0) {
       break;
     }
+    // the ring is full; let the device get on with
+    // what's queued so far, to free up descriptors.
+    if(*pending){
+      notify();
+      *pending = 0;
+    }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,24 +258,27 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    struct buf *b = bs[i-1];
+    disk.desc[idx[i]].addr = (uint64) b->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b->disk = 1;
+    disk.info[idx[i]].b = b;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].status = 0xff; // device writes 0 on success
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -264,21 +288,51 @@ virtio_disk_rw(struct buf *b, int write)
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  *pending = 1;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Start reading or writing the n buffers in bs[], telling
+// the device about them all at once, and return without
+// waiting. Buffers for consecutive blocks, next to each
+// other in bs[], go in one request. b->disk is 1 until the request for b is done;
+// virtio_disk_wait() waits for it. The caller must not
+// touch b->data meanwhile.
+void
+virtio_disk_start(struct buf **bs, int n, int write)
+{
+  int pending = 0;
+
+  acquire(&disk.vdisk_lock);
+  for(int i = 0, m; i < n; i += m){
+    for(m = 1; i+m < n && m < MAXRUN; m++)
+      if(bs[i+m]->dev != bs[i]->dev || bs[i+m]->blockno != bs[i]->blockno + m)
+        break;
+    queue(bs+i, m, write, &pending);
+  }
+  if(pending)
+    notify();
+  release(&disk.vdisk_lock);
+}
 
+// Wait for the request that virtio_disk_start() made for b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(&b, 1, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -304,9 +358,17 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    // the buffers are on the data descriptors.
+    for(int i = disk.desc[id].next; disk.info[i].b; i = disk.desc[i].next){
+      struct buf *b = disk.info[i].b;
+      disk.info[i].b = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->async)
+        bdone(b);    // read ahead; nobody is waiting
+      else
+        wakeup(b);
+    }
+    free_chain(id);
 
     disk.used_idx += 1;
   }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +13,17 @@
  */
 pagetable_t kernel_pagetable;
 
+// serializes changes to user PTEs that may be shared
+// copy-on-write, so that two threads breaking COW on
+// the same page, or a fork racing with a fault, agree
+// on who owns the page.
+struct spinlock vmlock;
+
+// does the hardware give each process its own ASID?
+// if not, every process uses ASID 0, like the kernel,
+// and trampoline.S flushes the TLB on each switch.
+int useasids;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -21,8 +34,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -54,6 +66,7 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&vmlock, "vm");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,10 +74,28 @@ kvminit(void)
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // unimplemented ASID bits read back as zero, so this
+  // sticks only if there are ASIDs for every process.
+  w_satp(MAKE_SATP(kernel_pagetable, NPROC));
+  useasids = SATP_ASID(r_satp()) == NPROC;
+
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
 }
 
+// Note that mappings in pagetable were removed or lost
+// permissions. If it is the current process's, every cpu
+// flushes its ASID before running it in user space again
+// (see usertrapret()). Other page tables are new, or dead.
+static void
+uvminval(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    __sync_fetch_and_add(&p->tlbgen, 1);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -77,26 +108,75 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, returns the level-1 leaf PTE
+// that maps it; walklevel() says which kind it is.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), and set *level to the level of the PTE:
+// 1 for a megapage, 0 otherwise.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
+  for(*level = 2; *level > 0; (*level)--) {
+    pte_t *pte = &pagetable[PX(*level, va)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte)) {
+      return pte;
+    } else if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the level-1 PTE for va, which maps a megapage
+// if it is a leaf, creating the level-1 page-table page
+// if alloc != 0 and it doesn't exist.
+static pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if((*pte & PTE_V) == 0){
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(1, va)];
+}
+
+// Map the megapage at pa at va; both must be aligned.
+// Returns 0 on success, -1 if walkmega() couldn't
+// allocate a needed page-table page.
+static int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  if(va % MEGAPGSIZE != 0 || pa % MEGAPGSIZE != 0)
+    panic("mapmega: not aligned");
+  if((pte = walkmega(pagetable, va, 1)) == 0)
+    return -1;
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -105,11 +185,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -117,17 +198,36 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va % MEGAPGSIZE);
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, with
+// megapages wherever va and pa are both aligned
+// and the range covers the whole megapage.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 end = va + sz, n;
+
+  while(va < end){
+    if(va % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - va >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if(mapmega(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+    } else {
+      n = MEGAPGSIZE - va % MEGAPGSIZE;
+      if(n > end - va)
+        n = end - va;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -156,23 +256,71 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Replace the megapage mapping *pte with a level-0
+// page table that maps the same memory in 4096-byte
+// pages, with the same permissions.
+// Returns 0, or -1 if out of memory.
+// Caller must hold vmlock.
+int
+uvmsplit(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  ksplit((void*)pa, MEGAORDER);
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never touched, and so
+// never mapped, are skipped. A megapage only partly in
+// the range is split first.
+// Optionally free the physical memory, or the swap
+// slots of pages that were swapped out.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  if(npages > 0)
+    uvminval(pagetable);
+
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_S){
+      if(do_free)
+        swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(level == 1 && a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= end){
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), MEGAORDER);
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      acquire(&vmlock);
+      if(uvmsplit(pte) < 0)
+        panic("uvmunmap: split");
+      release(&vmlock);
+      pte = walk(pagetable, a, 0);
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -189,10 +337,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -206,8 +353,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -225,12 +371,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -290,40 +435,285 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table, but shares the physical
+// memory: writable pages become read-only and
+// copy-on-write in both, and are copied by
+// uvmcow() on the first store.
+// The parent's stale TLB entries are flushed before
+// it next returns to user space.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Copy the mappings for [va, va+len) from old to new,
+// copy-on-write as in uvmcopy(), or, if shared is set,
+// mapping the same pages writable in both.
+// Swapped-out pages share the swap slot.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int shared)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  int level;
+
+  for(i = va; i < va + len; i += PGSIZE){
+    if((pte = walklevel(old, i, 0, &level)) == 0 || (*pte & (PTE_V|PTE_S)) == 0)
+      continue;  // not touched yet
+    acquire(&vmlock);
+    if(*pte & PTE_S){
+      if((npte = walk(new, i, 1)) == 0){
+        release(&vmlock);
+        goto err;
+      }
+      *npte = *pte;
+      swapdup(*pte);
+      release(&vmlock);
+      continue;
+    }
+    if(level == 1 && (i % MEGAPGSIZE != 0 || i + MEGAPGSIZE > va + len)){
+      // only part of the megapage is being copied.
+      if(uvmsplit(pte) < 0){
+        release(&vmlock);
+        goto err;
+      }
+      pte = walklevel(old, i, 0, &level);
+    }
+    if(!shared && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvminval(old);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(level == 1){
+      if(mapmega(new, i, pa, flags) != 0){
+        release(&vmlock);
+        goto err;
+      }
+      kref_pages((void*)pa, MEGAORDER);
+      release(&vmlock);
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+      release(&vmlock);
       goto err;
     }
+    kref((void*)pa);
+    release(&vmlock);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Handle a store to a copy-on-write page at va:
+// give the page table a private, writable copy,
+// or just make the page writable if no one else
+// shares it any more.
+// Returns 0 on success, -1 if va is not a COW page
+// or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level;
+
+  if(va >= MAXVA)
+    return -1;
+  acquire(&vmlock);
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte && (*pte & (PTE_V|PTE_U|PTE_W)) == (PTE_V|PTE_U|PTE_W)){
+    // another thread got here first.
+    release(&vmlock);
+    return 0;
+  }
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW)){
+    release(&vmlock);
+    return -1;
+  }
+  if(level == 1){
+    // copy just this page, not the whole megapage.
+    if(uvmsplit(pte) < 0){
+      release(&vmlock);
+      return -1;
+    }
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) > 1){
+    if((mem = kalloc()) == 0){
+      release(&vmlock);
+      return -1;
+    }
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    uvminval(pagetable);  // other threads must see the copy.
+    kfree((void*)pa);
+  } else {
+    *pte = PA2PTE(pa) | flags;
+  }
+  release(&vmlock);
+  return 0;
+}
+
+// Map the physical page pa at va, unless another
+// thread has mapped va in the meantime, or it has
+// been swapped out since, in which case pa is freed.
+// Returns 0 on success, -1 if walk() couldn't
+// allocate a needed page-table page.
+int
+uvminstall(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+
+  acquire(&vmlock);
+  pte = walk(pagetable, va, 1);
+  if(pte == 0 || (*pte & (PTE_V|PTE_S))){
+    release(&vmlock);
+    kfree((void*)pa);
+    return pte ? 0 : -1;
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  release(&vmlock);
+  return 0;
+}
+
+// Back the 2 MB-aligned heap region at a with one zeroed
+// megapage, if all of it is below p->sz, none of it is
+// mapped yet, and it holds no program segment. Only for
+// a region that is about to be filled: a fault on one
+// page allocates just that page.
+// Returns 0 on success, -1 to fall back to single pages.
+static int
+uvmmega(struct proc *p, uint64 a)
+{
+  struct seg *s;
+  pte_t *pte;
+  char *mem;
+
+  if(a + MEGAPGSIZE > p->sz)
+    return -1;
+  if((pte = walkmega(p->pagetable, a, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  for(s = p->segs; s < &p->segs[NSEG]; s++)
+    if(s->memsz && s->va < a + MEGAPGSIZE && s->va + s->memsz > a)
+      return -1;
+  if((mem = kalloc_pages(MEGAORDER)) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+
+  acquire(&vmlock);
+  if((pte = walkmega(p->pagetable, a, 1)) == 0 || (*pte & PTE_V)){
+    release(&vmlock);
+    kfree_pages(mem, MEGAORDER);
+    return -1;
+  }
+  *pte = PA2PTE(mem) | PTE_W|PTE_X|PTE_R|PTE_U|PTE_V;
+  release(&vmlock);
+  return 0;
+}
+
+// Handle a page fault at va in pagetable; access is
+// PTE_R, PTE_W or PTE_X, whichever the access needed.
+// A fault on an untouched page below the current
+// process's size reads it from the program file if
+// it is part of the program, or else allocates a
+// zeroed page: sbrk() only moves p->sz. Faults above it may be in an
+// mmap()ed region. A store to a copy-on-write page
+// gets a private copy. A swapped-out page is read
+// back in.
+// Returns 0 if the access can be retried,
+// -1 if it is an error.
+int
+vmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return -1;
+
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    if((*pte & PTE_U) == 0)
+      return -1;  // e.g. the stack guard page
+    if(access == PTE_W && (*pte & PTE_W) == 0)
+      return uvmcow(pagetable, va);
+    // another thread may have just mapped it.
+    return (*pte & access) ? 0 : -1;
+  }
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+  if(pte && (*pte & PTE_S))
+    return swapin(pagetable, va);
+  if(va >= p->sz)
+    return vmafault(va, access);
+  if(execseg(p, va))
+    return execfault(va, access);
+  if((mem = kalloc_swap()) == 0)
+    return -1;
+  return uvminstall(pagetable, va, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U);
+}
+
+// Look up user page va0 like walkaddr(), first faulting
+// it in if it has not been touched yet.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va0)
+{
+  uint64 pa0;
+
+  if((pa0 = walkaddr(pagetable, va0)) == 0 && vmfault(pagetable, va0, PTE_R) == 0)
+    pa0 = walkaddr(pagetable, va0);
+  return pa0;
+}
+
+// Fault in the mmap()ed, program and swapped-out pages of the
+// current process in [va, va+len), before a copy to or from them
+// that holds a lock the fault might need, or can't sleep under.
+// Heap faults never sleep, so untouched heap pages stay lazy,
+// except that a copy to a whole 2 MB-aligned region of the heap
+// gets a megapage for it.
+// The range isn't swapped out again until the system call
+// returns. Bad addresses are left for the copy to report.
+void
+uvmprefault(uint64 va, uint64 len, int access)
+{
+  struct proc *p = myproc();
+  struct thread *t = mythread();
+  pte_t *pte;
+  uint64 a;
+
+  t->pinva = va;
+  t->pinlen = len;
+  __sync_synchronize();
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    if(access == PTE_W && a % MEGAPGSIZE == 0 &&
+       a + MEGAPGSIZE <= va + len && uvmmega(p, a) == 0){
+      // the copy fills all of it.
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(a < p->sz && !execseg(p, a) &&
+       ((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_S) == 0))
+      continue;
+    if(vmfault(p->pagetable, a, access) < 0)
+      break;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -344,9 +734,16 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
+    if(va0 >= MAXVA)
+      return -1;
+    pte = walk(pagetable, va0, 0);
+    if((pte == 0 || (*pte & (PTE_V|PTE_W)) != (PTE_V|PTE_W)) &&
+       vmfault(pagetable, va0, PTE_W) < 0)
+      return -1;
     pa0 = walkaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
@@ -372,7 +769,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -399,7 +796,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
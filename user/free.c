@@ -0,0 +1,33 @@
+// Print how much physical memory is free, how fragmented
+// it is (the free blocks of each order), and how much
+// swap space and buffer cache are in use.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+int
+main(void)
+{
+  struct memstat st;
+  int k;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "free: memstat failed\n");
+    exit(1);
+  }
+  printf("total %d KB, free %d KB (%d KB zeroed, %d KB untouched)\n",
+         (int)(st.npages * 4), (int)(st.nfree * 4),
+         (int)(st.nzeroed * 4), (int)(st.nuncarved * 4));
+  printf("swap %d KB, used %d KB\n", (int)(st.nswap * 4), (int)(st.nswapped * 4));
+  printf("buffer cache %d KB, %d hits, %d misses, %d read ahead\n",
+         (int)(st.nbuf * BSIZE / 1024), (int)st.nbufhit, (int)st.nbufmiss,
+         (int)st.nbufahead);
+  printf("order\tsize\tblocks\n");
+  for(k = 0; k <= MAXORDER; k++)
+    printf("%d\t%dK\t%d\n", k, 4 << k, (int)st.nblocks[k]);
+  exit(0);
+}
@@ -0,0 +1,86 @@
+// Time parallel reads of cached files by 1, 2, ... n
+// processes, each reading its own file, to see whether
+// buffer cache lookups scale with the number of harts.
+// Each process does the same work, so on enough harts
+// the time should stay flat as processes are added.
+//
+// usage: readbench [n]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+
+#define NBLOCK 4    // blocks per file; all files fit in the cache
+#define ROUNDS 500  // times each process reads its file
+
+char buf[BSIZE];
+
+void
+name(char *path, int i)
+{
+  strcpy(path, "readbenchX");
+  path[9] = 'a' + i;
+}
+
+void
+reader(int i)
+{
+  char path[16];
+  int fd, r, b;
+
+  name(path, i);
+  for(r = 0; r < ROUNDS; r++){
+    if((fd = open(path, O_RDONLY)) < 0){
+      fprintf(2, "readbench: cannot open %s\n", path);
+      exit(1);
+    }
+    for(b = 0; b < NBLOCK; b++)
+      read(fd, buf, sizeof(buf));
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char path[16];
+  int n, i, k, fd, t0;
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  if(n < 1 || n > 26){
+    fprintf(2, "usage: readbench [n], 1 <= n <= 26\n");
+    exit(1);
+  }
+
+  memset(buf, 'r', sizeof(buf));
+  for(i = 0; i < n; i++){
+    name(path, i);
+    if((fd = open(path, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "readbench: cannot create %s\n", path);
+      exit(1);
+    }
+    for(k = 0; k < NBLOCK; k++)
+      write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+
+  for(k = 1; k <= n; k++){
+    t0 = uptime();
+    for(i = 0; i < k; i++){
+      if(fork() == 0)
+        reader(i);
+    }
+    for(i = 0; i < k; i++)
+      wait(0);
+    printf("%d readers: %d ticks\n", k, uptime() - t0);
+  }
+
+  for(i = 0; i < n; i++){
+    name(path, i);
+    unlink(path);
+  }
+  exit(0);
+}
@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int simplecmd(char*, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -145,6 +146,7 @@ int
 main(void)
 {
   static char buf[100];
+  char *argv[MAXARGS];
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -164,6 +166,15 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    // A plain command needs no copy of the shell to
+    // set up redirections or pipes in, so spawn it.
+    if(simplecmd(buf, argv) > 0){
+      if(spawn(argv[0], argv, 0, 0) < 0)
+        fprintf(2, "exec %s failed\n", argv[0]);
+      else
+        wait(0);
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
@@ -262,6 +273,41 @@ backcmd(struct cmd *subcmd)
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
+// If s is just a command name and arguments, split it
+// in place into argv and return the number of words.
+// Otherwise return -1 and leave s alone.
+int
+simplecmd(char *s, char **argv)
+{
+  char *p;
+  int argc, inword;
+
+  argc = 0;
+  inword = 0;
+  for(p = s; *p; p++){
+    if(strchr(symbols, *p))
+      return -1;
+    if(strchr(whitespace, *p))
+      inword = 0;
+    else if(!inword){
+      inword = 1;
+      argc++;
+    }
+  }
+  if(argc == 0 || argc >= MAXARGS)
+    return -1;
+
+  argc = 0;
+  for(p = s; *p; p++){
+    if(strchr(whitespace, *p))
+      *p = 0;
+    else if(p == s || *(p-1) == 0)
+      argv[argc++] = p;
+  }
+  argv[argc] = 0;
+  return argc;
+}
+
 int
 gettoken(char **ps, char *es, char **q, char **eq)
 {
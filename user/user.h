@@ -1,6 +1,8 @@
 struct stat;
 struct rtcdate;
 struct sigaction;
+struct memstat;
+struct spawn_action;
 
 // system calls
 int fork(void);
@@ -41,6 +43,12 @@ int  bsem_alloc(void);
 void bsem_free(int);
 void bsem_down(int);
 void bsem_up(int);
+int memstat(struct memstat*);
+void *mmap(void*, uint64, int, int, int, uint);
+int munmap(void*, uint64);
+int spawn(char*, char**, struct spawn_action*, int);
+int sync(void);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
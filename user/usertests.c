@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "kernel/spawn.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -569,9 +571,11 @@ writetest(char *s)
   }
 }
 
+// a file big enough to need a double-indirect block.
 void
 writebig(char *s)
 {
+  enum { N = NDIRECT + NINDIRECT + 2*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -580,7 +584,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -600,7 +604,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -669,6 +673,27 @@ void dirtest(char *s)
   }
 }
 
+// the program a process is running can't be written
+// or truncated under it; usertests itself is running.
+void
+textbusytest(char *s)
+{
+  int fd;
+
+  if((fd = open("usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("usertests", O_WRONLY)) >= 0 ||
+     (fd = open("usertests", O_RDWR)) >= 0 ||
+     (fd = open("usertests", O_RDONLY|O_TRUNC)) >= 0 ||
+     (fd = open("usertests", O_CREATE|O_WRONLY)) >= 0){
+    printf("%s: opened a running program for writing\n", s);
+    exit(1);
+  }
+}
+
 void
 exectest(char *s)
 {
@@ -2228,6 +2253,619 @@ kernmem(char *s)
   }
 }
 
+// sequential reads, which readi() reads ahead of, and
+// reads that jump around, must all see the right data.
+void
+readaheadtest(char *s)
+{
+  enum { N = NDIRECT + 40, CHUNK = 300 };
+  static char buf[BSIZE];
+  struct memstat st0, st1;
+  uint off;
+  int fd, fd2, i, n;
+
+  fd = open("readahead.tmp", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if((fd = open("readahead.tmp", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(off = 0; (n = read(fd, buf, CHUNK)) > 0; off += n){
+    for(i = 0; i < n; i++){
+      if(buf[i] != (char)((off + i) / BSIZE)){
+        printf("%s: wrong data at %d\n", s, off + i);
+        exit(1);
+      }
+    }
+  }
+  if(off != N*BSIZE){
+    printf("%s: read %d bytes\n", s, off);
+    exit(1);
+  }
+  close(fd);
+
+  // two readers of the same file, one half way through
+  // it, take turns; each is still sequential, and should
+  // still be read ahead.
+  fd = open("readahead.tmp", O_RDONLY);
+  fd2 = open("readahead.tmp", O_RDONLY);
+  if(fd < 0 || fd2 < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N/2; i++)
+    read(fd2, buf, BSIZE);
+  memstat(&st0);
+  for(i = 0; i < N/2; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)i ||
+       read(fd2, buf, BSIZE) != BSIZE || buf[0] != (char)(N/2 + i)){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  memstat(&st1);
+  close(fd);
+  close(fd2);
+  unlink("readahead.tmp");
+  if(st1.nbufahead - st0.nbufahead < N/2){
+    printf("%s: interleaved readers not read ahead\n", s);
+    exit(1);
+  }
+}
+
+// fsync() and sync() should succeed, and leave the
+// file system as it was.
+void
+synctest(char *s)
+{
+  char buf[16];
+  int fd, i;
+
+  fd = open("sync.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    if(write(fd, "0123456789abcdef", 16) != 16){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    if(i % 5 == 0 && fsync(fd) != 0){
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+  }
+  if(sync() != 0){
+    printf("%s: sync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1 || fsync(-1) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("sync.tmp", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, 16) != 16 || memcmp(buf, "0123456789abcdef", 16) != 0){
+      printf("%s: wrong data after sync\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("sync.tmp");
+  sync();
+}
+
+// reading a file a second time should find
+// its blocks in the buffer cache.
+void
+bcachetest(char *s)
+{
+  enum { N = 8 };
+  struct memstat st0, st1;
+  static char buf[BSIZE];
+  int fd, i, pass;
+
+  fd = open("bcache.tmp", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+
+  for(pass = 0; pass < 2; pass++){
+    memstat(&st0);
+    if((fd = open("bcache.tmp", O_RDONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    memstat(&st1);
+  }
+  unlink("bcache.tmp");
+  if(st1.nbufhit - st0.nbufhit < N){
+    printf("%s: second read missed the cache\n", s);
+    exit(1);
+  }
+  if(st1.nbuf < NBUF){
+    printf("%s: cache holds %d blocks\n", s, (int)st1.nbuf);
+    exit(1);
+  }
+}
+
+// does memstat add up, and does it see pages being
+// allocated and freed?
+void
+memstattest(char *s)
+{
+  struct memstat st0, st1;
+  uint64 n;
+  char *a;
+  int k;
+
+  if(memstat(&st0) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  n = st0.nuncarved + st0.nzeroed;
+  for(k = 0; k <= MAXORDER; k++)
+    n += st0.nblocks[k] << k;
+  if(n != st0.nfree || st0.nfree > st0.npages){
+    printf("%s: inconsistent memstat\n", s);
+    exit(1);
+  }
+
+  a = sbrk(64*PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(k = 0; k < 64; k++)
+    a[k*PGSIZE] = 1;
+  memstat(&st1);
+  if(st1.nfree + 64 > st0.nfree){
+    printf("%s: memstat missed allocation\n", s);
+    exit(1);
+  }
+  sbrk(-64*PGSIZE);
+  memstat(&st1);
+  if(st1.nfree + 8 < st0.nfree){
+    printf("%s: memstat missed free\n", s);
+    exit(1);
+  }
+}
+
+// does fork share memory copy-on-write, and does each
+// side see only its own writes, including writes made
+// by the kernel on the process's behalf?
+void
+cowtest(char *s)
+{
+  struct memstat st0, st1;
+  int npages = 200, fds[2];
+  int i, pid, xstatus;
+  char *a;
+
+  a = sbrk(npages*PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < npages; i++)
+    a[i*PGSIZE] = i;
+  memstat(&st0);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    memstat(&st1);
+    if(st1.nfree + npages/2 < st0.nfree){
+      printf("%s: fork copied memory\n", s);
+      exit(1);
+    }
+    for(i = 0; i < npages; i++){
+      if(a[i*PGSIZE] != (char)i){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    // the kernel's copyout() must break COW too.
+    if(pipe(fds) < 0 || write(fds[1], "x", 1) != 1 ||
+       read(fds[0], a + PGSIZE + 1, 1) != 1){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < npages; i++)
+      a[i*PGSIZE] = -1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(i = 0; i < npages; i++){
+    if(a[i*PGSIZE] != (char)i || a[i*PGSIZE+1] != 0){
+      printf("%s: parent sees child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-npages*PGSIZE);
+}
+
+// sbrk() should only reserve address space; pages are
+// allocated when touched, by the process or by the kernel.
+void
+lazysbrk(char *s)
+{
+  enum { BIG=256*1024*1024 };
+  struct memstat st0, st1;
+  int fds[2];
+  char *a;
+
+  memstat(&st0);
+  a = sbrk(BIG);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a[BIG-1] = 1;
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  // copyin() from, and copyout() to, untouched pages.
+  if(write(fds[1], a + BIG/2, 10) != 10 || read(fds[0], a + BIG/4, 10) != 10){
+    printf("%s: read/write of untouched page failed\n", s);
+    exit(1);
+  }
+  if(a[BIG/4] != 0 || a[BIG-1] != 1){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  memstat(&st1);
+  if(st1.nfree + 64 < st0.nfree){
+    printf("%s: sbrk allocated eagerly\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-BIG);
+}
+
+// a read() into a whole megapage of the heap gets a
+// megapage; fork() shares it copy-on-write and
+// shrinking the heap splits it.
+void
+megapage(char *s)
+{
+  struct memstat st0, st1;
+  char *a, *m;
+  uint64 i;
+  int fds[2], pid, xstatus;
+
+  a = sbrk(3*MEGAPGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  m = (char*)MEGAPGROUNDDOWN((uint64)a + MEGAPGSIZE - 1);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  memstat(&st0);
+  if(write(fds[1], "x", 1) != 1 || read(fds[0], m, MEGAPGSIZE) != 1){
+    printf("%s: pipe read failed\n", s);
+    exit(1);
+  }
+  memstat(&st1);
+  close(fds[0]);
+  close(fds[1]);
+  if(st1.nfree + MEGAPGSIZE/PGSIZE > st0.nfree){
+    printf("%s: no megapage\n", s);
+    exit(1);
+  }
+  for(i = 0; i < MEGAPGSIZE; i += PGSIZE)
+    m[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < MEGAPGSIZE; i += PGSIZE){
+      if(m[i] != (char)(i / PGSIZE))
+        exit(1);
+      m[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+
+  // cut the megapage in half.
+  sbrk(-((char*)sbrk(0) - (m + MEGAPGSIZE/2)));
+  for(i = 0; i < MEGAPGSIZE/2; i += PGSIZE){
+    if(m[i] != (char)(i / PGSIZE)){
+      printf("%s: parent saw wrong data\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-((char*)sbrk(0) - a));
+}
+
+// touch more memory than is free, so that some of it
+// has to be swapped out, and check it all comes back.
+void
+swaptest(char *s)
+{
+  struct memstat st;
+  uint64 i, n, extra;
+  char *a;
+
+  if(memstat(&st) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(st.nswap == 0)
+    return;  // no swap area
+  extra = st.nswap / 4 < 1024 ? st.nswap / 4 : 1024;
+  n = st.nfree + extra;
+  a = sbrk(n * PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    *(uint64*)(a + i*PGSIZE) = i;
+  for(i = 0; i < n; i++){
+    if(*(uint64*)(a + i*PGSIZE) != i){
+      printf("%s: page %d came back wrong\n", s, (int)i);
+      exit(1);
+    }
+  }
+  memstat(&st);
+  if(st.nswapped == 0){
+    printf("%s: nothing was swapped out\n", s);
+    exit(1);
+  }
+  sbrk(-(n * PGSIZE));
+}
+
+// mmap() a file privately and shared; check what the
+// mapping sees and what reaches the file.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*PGSIZE + PGSIZE/2 };
+  char buf[64];
+  char *a, *b;
+  int fd, i, pid, xstatus;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += sizeof(buf)){
+    memset(buf, 'a' + (i / PGSIZE), sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // a read-only file can't be mapped shared and writable.
+  fd = open("mmapfile", O_RDONLY);
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (void*)-1){
+    printf("%s: mmap of read-only file for writing succeeded\n", s);
+    exit(1);
+  }
+
+  // private: writes stay in memory.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(a == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a' || a[PGSIZE] != 'b' || a[SZ-1] != 'c' || a[SZ] != 0){
+    printf("%s: wrong mapped data\n", s);
+    exit(1);
+  }
+  a[0] = 'x';
+  if(munmap(a, SZ) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes by a child reach the parent and the file.
+  fd = open("mmapfile", O_RDWR);
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[1] = 'y';
+    a[PGSIZE+1] = 'z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[1] != 'y'){
+    printf("%s: parent didn't see child's write\n", s);
+    exit(1);
+  }
+
+  // another mapping of the file, and write(), use the same pages.
+  fd = open("mmapfile", O_RDWR);
+  b = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, PGSIZE);
+  if(b == (char*)-1 || b[1] != 'z'){
+    printf("%s: second mapping didn't see shared write\n", s);
+    exit(1);
+  }
+  b[2] = 'v';
+  if(write(fd, "w", 1) != 1 || a[0] != 'w' || a[PGSIZE+2] != 'v'){
+    printf("%s: mappings of one file differ\n", s);
+    exit(1);
+  }
+  munmap(b, PGSIZE);
+  close(fd);
+
+  if(munmap(a, PGSIZE) < 0 || munmap(a + PGSIZE, SZ - PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 2) != 2 || buf[1] != 'y'){
+    printf("%s: shared write not written back\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// anonymous shared memory: a child's writes should be
+// visible to its parent with no copying, and private
+// anonymous memory should not be shared.
+void
+shmtest(char *s)
+{
+  enum { SZ = 4*PGSIZE };
+  int *shared, *private;
+  int i, pid, xstatus;
+
+  shared = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  private = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(shared == (int*)-1 || private == (int*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(shared[0] != 0 || private[SZ/sizeof(int)-1] != 0){
+    printf("%s: anonymous memory not zeroed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ/sizeof(int); i += 512){
+      shared[i] = i;
+      private[i] = i;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(i = 512; i < SZ/sizeof(int); i += 512){
+    if(shared[i] != i){
+      printf("%s: parent didn't see shared write\n", s);
+      exit(1);
+    }
+    if(private[i] != 0){
+      printf("%s: parent saw private write\n", s);
+      exit(1);
+    }
+  }
+  munmap(shared, SZ);
+  munmap(private, SZ);
+}
+
+// spawn() a child with its output redirected to a pipe.
+void
+spawntest(char *s)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  struct spawn_action act[2];
+  char buf[32];
+  int fds[2], pid, n, m, xstatus;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_DUP2;
+  act[0].fd = fds[1];
+  act[0].newfd = 1;
+  act[1].op = SPAWN_CLOSE;
+  act[1].fd = fds[0];
+  pid = spawn("echo", args, act, 2);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = 0;
+  while(n < sizeof(buf)-1 && (m = read(fds[0], buf+n, sizeof(buf)-1-n)) > 0)
+    n += m;
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wrong child\n", s);
+    exit(1);
+  }
+  buf[n] = 0;
+  if(strcmp(buf, "spawned\n") != 0){
+    printf("%s: read %s\n", s, buf);
+    exit(1);
+  }
+
+  if(spawn("nonexistent", args, 0, 0) >= 0){
+    printf("%s: spawned nonexistent\n", s);
+    exit(1);
+  }
+  act[0].op = SPAWN_CLOSE;
+  act[0].fd = NOFILE;
+  if(spawn("echo", args, act, 1) >= 0){
+    printf("%s: bad action accepted\n", s);
+    exit(1);
+  }
+}
+
 // if we run the system out of memory, does it clean up the last
 // failed allocation?
 void
@@ -2797,11 +3435,23 @@ main(int argc, char *argv[])
     {sharedfd, "sharedfd"},
     {dirtest, "dirtest"},
     {exectest, "exectest"},
+    {textbusytest, "textbusy"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {memstattest, "memstat"},
+    {bcachetest, "bcache"},
+    {readaheadtest, "readahead"},
+    {synctest, "sync"},
+    {cowtest, "cowtest"},
+    {lazysbrk, "lazysbrk"},
+    {mmaptest, "mmap"},
+    {shmtest, "shm"},
+    {spawntest, "spawn"},
+    {megapage, "megapage"},
+    {swaptest, "swap"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -682,9 +682,11 @@ writetest(char *s)
   }
 }
 
+// a file big enough to need a double-indirect block.
 void
 writebig(char *s)
 {
+  enum { N = NDIRECT + NINDIRECT + 2*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -693,7 +695,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -713,7 +715,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
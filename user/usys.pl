@@ -46,4 +46,10 @@ entry("kthread_join");
 entry("bsem_alloc");
 entry("bsem_free");
 entry("bsem_down");
-entry("bsem_up");
\ No newline at end of file
+entry("bsem_up");
+entry("memstat");
+entry("mmap");
+entry("munmap");
+entry("spawn");
+entry("sync");
+entry("fsync");
\ No newline at end of file